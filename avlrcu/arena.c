@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/cache.h>
+#include <linux/llist.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+
+#include "test.h"
+
+/*
+ * Hot memory for the top levels of the test trees.
+ * Every lookup goes through the top levels, keep them on a few contiguous pages,
+ * one node per cache line, instead of scattered over the slab.
+ * When the arena is exhausted, the tree falls back to test_alloc().
+ */
+#define ARENA_ORDER	4
+#define ARENA_SIZE	(PAGE_SIZE << ARENA_ORDER)
+#define ARENA_SLOT	L1_CACHE_ALIGN(sizeof(struct test_avlrcu_node))
+
+static void *arena;
+
+/* the test tree & the benchmark trees share the arena */
+static DEFINE_SPINLOCK(arena_lock);
+static LLIST_HEAD(arena_slots);		/* free slots, protected by the lock */
+static LLIST_HEAD(arena_freed);		/* slots returned without the lock (RCU callbacks) */
+
+int arena_init(void)
+{
+	struct test_avlrcu_node *container;
+	struct page *page;
+	long slot;
+
+	page = alloc_pages(GFP_KERNEL, ARENA_ORDER);
+	if (!page)
+		return -ENOMEM;
+
+	arena = page_address(page);
+
+	/* slots get used in address order */
+	for (slot = ARENA_SIZE / ARENA_SLOT - 1; slot >= 0; slot--) {
+		container = arena + slot * ARENA_SLOT;
+		__llist_add(&container->node.old, &arena_slots);
+	}
+
+	return 0;
+}
+
+/* all the slots must be returned, wait for the RCU callbacks before calling this */
+void arena_exit(void)
+{
+	free_pages((unsigned long)arena, ARENA_ORDER);
+	arena = NULL;
+}
+
+bool arena_contains(const struct test_avlrcu_node *container)
+{
+	return (void *)container >= arena && (void *)container < arena + ARENA_SIZE;
+}
+
+struct test_avlrcu_node *arena_alloc(void)
+{
+	struct test_avlrcu_node *container;
+	struct llist_node *first;
+
+	spin_lock(&arena_lock);
+
+	if (llist_empty(&arena_slots))
+		arena_slots.first = llist_del_all(&arena_freed);
+
+	first = arena_slots.first;
+	if (first)
+		arena_slots.first = first->next;
+
+	spin_unlock(&arena_lock);
+
+	if (!first)
+		return NULL;
+
+	container = llist_entry(first, struct test_avlrcu_node, node.old);
+	memset(container, 0, sizeof(struct test_avlrcu_node));
+
+	return container;
+}
+
+void arena_free(struct test_avlrcu_node *container)
+{
+	llist_add(&container->node.old, &arena_freed);
+}
+
+static void arena_free_cb(struct rcu_head *head)
+{
+	struct test_avlrcu_node *container;
+	container = container_of(head, struct test_avlrcu_node, node.rcu);
+
+	arena_free(container);
+}
+
+void arena_free_rcu(struct test_avlrcu_node *container)
+{
+	call_rcu(&container->node.rcu, arena_free_cb);
+}
@@ -0,0 +1,1278 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/err.h>
+#include <linux/sort.h>
+
+#include "test.h"
+#include "fat.h"
+#include "typed.h"
+
+/*
+ * Benchmarks run on private trees, built from random keys for each run.
+ * The test tree is not touched.
+ *
+ * echo "search 1000000 10000000" > /sys/kernel/debug/avlrcu/bench
+ * cat /sys/kernel/debug/avlrcu/bench
+ *
+ * Build with AVLRCU_DEBUG=n, the validation after each update is O(n).
+ */
+
+// one benchmark at a time, the result is kept for reading
+static DEFINE_TEST_REPORT(bench_report);
+
+#define BENCH_SEED	0x2545f4914f6cdd1dull
+
+// readers drop RCU & reschedule every chunk
+#define BENCH_CHUNK	1024
+
+/* xorshift64*, fast & reproducible */
+static inline u64 bench_rand(u64 *state)
+{
+	u64 x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return x * 0x2545f4914f6cdd1dull;
+}
+
+struct bench_tree {
+	struct avlrcu_root root;
+	unsigned long *keys;		/* keys in the tree, unordered */
+	unsigned long count;
+	u64 state;			/* random state for new keys */
+};
+
+/* memory waiting for RCU before the updates get throttled */
+#define BENCH_HIGH_WATER	(64 << 20)
+
+/* insert a node with a new random key */
+static int bench_insert_random(struct bench_tree *tree, unsigned long *key)
+{
+	int result;
+
+	for (;;) {
+		/* invalid value 0, same as the test interface */
+		*key = bench_rand(&tree->state);
+		if (!*key)
+			continue;
+
+		result = test_insert(&tree->root, *key);
+		if (result != -EEXIST)
+			return result;
+	}
+}
+
+static int bench_build(struct bench_tree *tree, unsigned long count)
+{
+	unsigned long i;
+	int result;
+
+	avlrcu_init(&tree->root, &test_ops);
+	tree->root.reclaim.high_water = BENCH_HIGH_WATER;
+	tree->count = count;
+	tree->state = BENCH_SEED;
+
+	tree->keys = kvmalloc_array(count, sizeof(unsigned long), GFP_KERNEL);
+	if (!tree->keys)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		result = bench_insert_random(tree, &tree->keys[i]);
+		if (result)
+			goto error;
+
+		if (!(i % BENCH_CHUNK))
+			cond_resched();
+	}
+
+	return 0;
+
+error:
+	avlrcu_free(&tree->root);
+	kvfree(tree->keys);
+
+	return result;
+}
+
+static void bench_destroy(struct bench_tree *tree)
+{
+	test_destroy(&tree->root);
+	kvfree(tree->keys);
+}
+
+/* random lookups of existing keys, returns the duration in ns */
+static u64 bench_lookups(struct bench_tree *tree, unsigned long lookups, unsigned long *found)
+{
+	struct test_avlrcu_node match;
+	u64 state = ~BENCH_SEED;
+	unsigned long i, j;
+	u64 start;
+
+	*found = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < lookups; ) {
+		rcu_read_lock();
+
+		for (j = 0; j < BENCH_CHUNK && i < lookups; j++, i++) {
+			match.address = tree->keys[bench_rand(&state) % tree->count];
+			if (avlrcu_search(&tree->root, &match.node))
+				(*found)++;
+		}
+
+		rcu_read_unlock();
+		cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* lookups per avlrcu_search_batch() call */
+#define BENCH_BATCH	32
+
+/* same lookups as bench_lookups(), in batches */
+static u64 bench_lookups_batch(struct bench_tree *tree, unsigned long lookups, unsigned long *found)
+{
+	/* serialized by the report lock */
+	static struct test_avlrcu_node match[BENCH_BATCH];
+	static const struct avlrcu_node *matches[BENCH_BATCH];
+	static const struct avlrcu_node *results[BENCH_BATCH];
+	u64 state = ~BENCH_SEED;
+	unsigned long i, j;
+	int k, count;
+	u64 start;
+
+	for (k = 0; k < BENCH_BATCH; k++)
+		matches[k] = &match[k].node;
+
+	*found = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < lookups; ) {
+		rcu_read_lock();
+
+		for (j = 0; j < BENCH_CHUNK && i < lookups; j += count, i += count) {
+			count = min_t(unsigned long, BENCH_BATCH, lookups - i);
+
+			for (k = 0; k < count; k++)
+				match[k].address = tree->keys[bench_rand(&state) % tree->count];
+
+			*found += avlrcu_search_batch(&tree->root, matches, results, count);
+		}
+
+		rcu_read_unlock();
+		cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* 7 of 8 lookups go to a few hot keys */
+#define BENCH_HOT_KEYS	32
+
+static unsigned long bench_skewed_key(struct bench_tree *tree, u64 *state)
+{
+	u64 r = bench_rand(state);
+
+	if (r & 7)
+		return tree->keys[(r >> 3) % min_t(unsigned long, tree->count, BENCH_HOT_KEYS)];
+	else
+		return tree->keys[(r >> 3) % tree->count];
+}
+
+static unsigned long bench_hash(const struct avlrcu_node *node)
+{
+	return avlrcu_entry(node, struct test_avlrcu_node, node)->address;
+}
+
+/* skewed lookups, through the cache if there is one */
+static u64 bench_lookups_skewed(struct bench_tree *tree, struct avlrcu_cache *cache,
+				unsigned long lookups, unsigned long *found)
+{
+	struct test_avlrcu_node match;
+	const struct avlrcu_node *node;
+	u64 state = ~BENCH_SEED;
+	unsigned long i, j;
+	u64 start;
+
+	*found = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < lookups; ) {
+		rcu_read_lock();
+
+		for (j = 0; j < BENCH_CHUNK && i < lookups; j++, i++) {
+			match.address = bench_skewed_key(tree, &state);
+			if (cache)
+				node = avlrcu_search_cached(&tree->root, cache, &match.node);
+			else
+				node = avlrcu_search(&tree->root, &match.node);
+			if (node)
+				(*found)++;
+		}
+
+		rcu_read_unlock();
+		cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+static int bench_cmp_keys(const void *a, const void *b)
+{
+	unsigned long key_a = *(const unsigned long *)a;
+	unsigned long key_b = *(const unsigned long *)b;
+
+	return key_a < key_b ? -1 : key_a > key_b;
+}
+
+/* lookups of consecutive keys (sorted keys array), from the previous match if finger is set */
+static u64 bench_lookups_sequential(struct bench_tree *tree, bool finger,
+				    unsigned long lookups, unsigned long *found)
+{
+	struct test_avlrcu_node match;
+	const struct avlrcu_node *node;
+	unsigned long i, j;
+	u64 start;
+
+	*found = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < lookups; ) {
+		rcu_read_lock();
+
+		/* the hint is only valid in the same RCU section */
+		node = NULL;
+
+		for (j = 0; j < BENCH_CHUNK && i < lookups; j++, i++) {
+			match.address = tree->keys[i % tree->count];
+			if (finger)
+				node = avlrcu_search_from(&tree->root, node, &match.node);
+			else
+				node = avlrcu_search(&tree->root, &match.node);
+			if (node)
+				(*found)++;
+		}
+
+		rcu_read_unlock();
+		cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+static u64 bench_key(const struct avlrcu_node *node)
+{
+	return avlrcu_entry(node, struct test_avlrcu_node, node)->address;
+}
+
+/* same lookups as bench_lookups(), on the frozen index */
+static u64 bench_lookups_frozen(struct bench_tree *tree, struct avlrcu_frozen *frozen,
+				unsigned long lookups, unsigned long *found)
+{
+	u64 state = ~BENCH_SEED;
+	unsigned long i;
+	u64 start;
+
+	*found = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < lookups; i++) {
+		if (avlrcu_frozen_search(frozen, tree->keys[bench_rand(&state) % tree->count]))
+			(*found)++;
+
+		if (!(i % BENCH_CHUNK))
+			cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* same lookups as bench_lookups(), on the fat node tree */
+static u64 bench_lookups_fat(struct bench_tree *tree, struct avlrcu_fat_root *fat,
+			     unsigned long lookups, unsigned long *found)
+{
+	u64 state = ~BENCH_SEED;
+	unsigned long i, j;
+	u64 start;
+
+	*found = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < lookups; ) {
+		rcu_read_lock();
+
+		for (j = 0; j < BENCH_CHUNK && i < lookups; j++, i++)
+			if (avlrcu_fat_search(fat, tree->keys[bench_rand(&state) % tree->count]))
+				(*found)++;
+
+		rcu_read_unlock();
+		cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* same lookups as bench_lookups(), outside RCU, validated by the seqcount */
+static u64 bench_lookups_epoch(struct bench_tree *tree, unsigned long lookups, unsigned long *found)
+{
+	struct test_avlrcu_node match;
+	u64 state = ~BENCH_SEED;
+	unsigned long i, j;
+	u64 start;
+	int idx;
+
+	*found = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < lookups; ) {
+		idx = avlrcu_epoch_enter(&tree->root);
+
+		for (j = 0; j < BENCH_CHUNK && i < lookups; j++, i++) {
+			match.address = tree->keys[bench_rand(&state) % tree->count];
+			if (avlrcu_search_seq(&tree->root, &match.node))
+				(*found)++;
+		}
+
+		avlrcu_epoch_exit(&tree->root, idx);
+		cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* the test objects, with the key comparisons inlined */
+DEFINE_AVLRCU_TREE(bench_typed, struct test_avlrcu_node, node, address, avlrcu_key_int)
+
+/* same lookups as bench_lookups(), through the typed calls */
+static u64 bench_lookups_typed(struct bench_tree *tree, struct avlrcu_root *typed,
+			       unsigned long lookups, unsigned long *found)
+{
+	u64 state = ~BENCH_SEED;
+	unsigned long i, j;
+	u64 start;
+
+	*found = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < lookups; ) {
+		rcu_read_lock();
+
+		for (j = 0; j < BENCH_CHUNK && i < lookups; j++, i++)
+			if (bench_typed_search(typed, &tree->keys[bench_rand(&state) % tree->count]))
+				(*found)++;
+
+		rcu_read_unlock();
+		cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+static int bench_search(unsigned long nodes, unsigned long ops)
+{
+	struct bench_tree tree;
+	unsigned long found;
+	u64 duration;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	duration = bench_lookups(&tree, ops, &found);
+
+	test_printf(&bench_report, "search: %lu nodes, %lu lookups, %lu found, %llu ns/lookup, prefetch %s\n",
+		nodes, ops, found, div64_u64(duration, ops),
+		IS_ENABLED(AVLRCU_PREFETCH) ? "on" : "off");
+
+	bench_destroy(&tree);
+
+	return 0;
+}
+
+/* sequential searches against batched searches, on the same keys */
+static int bench_batch(unsigned long nodes, unsigned long ops)
+{
+	struct bench_tree tree;
+	unsigned long found, found_batch;
+	u64 sequential, batched;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	sequential = bench_lookups(&tree, ops, &found);
+	batched = bench_lookups_batch(&tree, ops, &found_batch);
+
+	test_printf(&bench_report, "batch: %lu nodes, %lu lookups, %d per batch, ns/lookup: sequential %llu, batched %llu\n",
+		nodes, ops, BENCH_BATCH, div64_u64(sequential, ops), div64_u64(batched, ops));
+
+	if (found != found_batch) {
+		pr_err("%s: found %lu sequential, %lu batched\n", __func__, found, found_batch);
+		result = -EINVAL;
+	}
+
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* skewed lookups with & without the per-CPU cache */
+static int bench_cache(unsigned long nodes, unsigned long ops)
+{
+	struct avlrcu_cache cache;
+	struct bench_tree tree;
+	unsigned long found, found_cached;
+	unsigned long hits, misses;
+	u64 plain, cached;
+	int result;
+
+	result = avlrcu_cache_init(&cache, bench_hash);
+	if (result)
+		return result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		goto out_cache;
+
+	plain = bench_lookups_skewed(&tree, NULL, ops, &found);
+	cached = bench_lookups_skewed(&tree, &cache, ops, &found_cached);
+	avlrcu_cache_stats(&cache, &hits, &misses);
+
+	test_printf(&bench_report, "cache: %lu nodes, %lu lookups, %d hot keys, ns/lookup: plain %llu, cached %llu, hits %lu, misses %lu\n",
+		nodes, ops, BENCH_HOT_KEYS, div64_u64(plain, ops), div64_u64(cached, ops), hits, misses);
+
+	if (found != found_cached) {
+		pr_err("%s: found %lu plain, %lu cached\n", __func__, found, found_cached);
+		result = -EINVAL;
+	}
+
+	bench_destroy(&tree);
+out_cache:
+	avlrcu_cache_free(&cache);
+
+	return result;
+}
+
+/* consecutive lookups from the root & from the previous match */
+static int bench_finger(unsigned long nodes, unsigned long ops)
+{
+	struct bench_tree tree;
+	unsigned long found, found_finger;
+	u64 plain, finger;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	sort(tree.keys, tree.count, sizeof(unsigned long), bench_cmp_keys, NULL);
+
+	plain = bench_lookups_sequential(&tree, false, ops, &found);
+	finger = bench_lookups_sequential(&tree, true, ops, &found_finger);
+
+	test_printf(&bench_report, "finger: %lu nodes, %lu lookups, ns/lookup: from root %llu, from previous %llu\n",
+		nodes, ops, div64_u64(plain, ops), div64_u64(finger, ops));
+
+	if (found != found_finger) {
+		pr_err("%s: found %lu from root, %lu from previous\n", __func__, found, found_finger);
+		result = -EINVAL;
+	}
+
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* lookups on the tree & on a frozen index made of a snapshot */
+static int bench_frozen(unsigned long nodes, unsigned long ops)
+{
+	struct avlrcu_snapshot *snap;
+	struct avlrcu_frozen *frozen;
+	struct bench_tree tree;
+	unsigned long found, found_frozen;
+	u64 plain, indexed;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	snap = avlrcu_snapshot(&tree.root);
+	if (IS_ERR(snap)) {
+		result = PTR_ERR(snap);
+		goto out;
+	}
+
+	frozen = avlrcu_freeze(&snap->root, bench_key);
+	avlrcu_snapshot_put(snap);
+	if (IS_ERR(frozen)) {
+		result = PTR_ERR(frozen);
+		goto out;
+	}
+
+	plain = bench_lookups(&tree, ops, &found);
+	indexed = bench_lookups_frozen(&tree, frozen, ops, &found_frozen);
+
+	test_printf(&bench_report, "frozen: %lu nodes, %lu lookups, ns/lookup: tree %llu, frozen %llu\n",
+		nodes, ops, div64_u64(plain, ops), div64_u64(indexed, ops));
+
+	if (found != found_frozen) {
+		pr_err("%s: found %lu in the tree, %lu frozen\n", __func__, found, found_frozen);
+		result = -EINVAL;
+	}
+
+	avlrcu_frozen_free(frozen);
+out:
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* lookups on the binary tree & on a fat node tree with the same keys, then delete half of them */
+static int bench_fat(unsigned long nodes, unsigned long ops)
+{
+	struct avlrcu_fat_root fat;
+	struct bench_tree tree;
+	unsigned long found, found_fat;
+	unsigned long i;
+	u64 binary, wide;
+	void *value;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	/* the values are the keys */
+	avlrcu_fat_init(&fat);
+	for (i = 0; i < tree.count; i++) {
+		result = avlrcu_fat_insert(&fat, tree.keys[i], (void *)tree.keys[i]);
+		if (result)
+			goto out;
+
+		if (!(i % BENCH_CHUNK))
+			cond_resched();
+	}
+
+	binary = bench_lookups(&tree, ops, &found);
+	wide = bench_lookups_fat(&tree, &fat, ops, &found_fat);
+
+	test_printf(&bench_report, "fat: %lu nodes, %lu lookups, %d keys per node, ns/lookup: binary %llu, fat %llu\n",
+		nodes, ops, AVLRCU_FAT_KEYS, div64_u64(binary, ops), div64_u64(wide, ops));
+
+	if (found != found_fat) {
+		pr_err("%s: found %lu binary, %lu fat\n", __func__, found, found_fat);
+		result = -EINVAL;
+		goto out;
+	}
+
+	/* exercise the delete path, every other key goes */
+	for (i = 0; i < tree.count; i += 2) {
+		value = avlrcu_fat_delete(&fat, tree.keys[i]);
+		if (IS_ERR(value)) {
+			result = PTR_ERR(value);
+			goto out;
+		}
+
+		if (!(i % BENCH_CHUNK))
+			cond_resched();
+	}
+
+	rcu_read_lock();
+	for (i = 0; i < tree.count; i++) {
+		value = avlrcu_fat_search(&fat, tree.keys[i]);
+		if ((i % 2 == 0) != (value == NULL)) {
+			pr_err("%s: key %lx wrongly %s\n", __func__, tree.keys[i], value ? "found" : "missing");
+			result = -EINVAL;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+out:
+	avlrcu_fat_free(&fat);
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* replace random keys with new ones, the size of the tree doesn't change */
+static int bench_churn(struct bench_tree *tree, unsigned long updates)
+{
+	struct test_avlrcu_node match;
+	struct avlrcu_node *node;
+	unsigned long i, index;
+	int result;
+
+	for (i = 0; i < updates; i++) {
+		index = bench_rand(&tree->state) % tree->count;
+		match.address = tree->keys[index];
+
+		node = avlrcu_delete(&tree->root, &match.node);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		avlrcu_retire(&tree->root, node);
+
+		result = bench_insert_random(tree, &tree->keys[index]);
+		if (result)
+			return result;
+
+		if (!(i % BENCH_CHUNK)) {
+			avlrcu_reclaim_throttle(&tree->root);
+			cond_resched();
+		}
+	}
+
+	return 0;
+}
+
+/* give random keys a new object, by delete & insert or by replace, returns the duration in ns */
+static u64 bench_update(struct bench_tree *tree, bool replace, unsigned long updates, int *result)
+{
+	struct test_avlrcu_node match, *container;
+	struct avlrcu_node *node;
+	u64 state = ~BENCH_SEED;
+	unsigned long i;
+	u64 start;
+
+	*result = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < updates; i++) {
+		match.address = tree->keys[bench_rand(&state) % tree->count];
+
+		container = kzalloc(sizeof(struct test_avlrcu_node), GFP_KERNEL);
+		if (!container) {
+			*result = -ENOMEM;
+			break;
+		}
+		container->address = match.address;
+
+		if (replace) {
+			*result = avlrcu_replace(&tree->root, &match.node, &container->node);
+		}
+		else {
+			node = avlrcu_delete(&tree->root, &match.node);
+			if (IS_ERR(node))
+				*result = PTR_ERR(node);
+			else {
+				avlrcu_retire(&tree->root, node);
+				*result = avlrcu_insert(&tree->root, &container->node);
+			}
+		}
+
+		if (*result) {
+			kfree(container);
+			break;
+		}
+
+		if (!(i % BENCH_CHUNK)) {
+			avlrcu_reclaim_throttle(&tree->root);
+			cond_resched();
+		}
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* new objects for existing keys, delete & insert against replace */
+static int bench_replace(unsigned long nodes, unsigned long ops)
+{
+	struct bench_tree tree;
+	u64 reinserted, replaced;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	reinserted = bench_update(&tree, false, ops, &result);
+	if (result)
+		goto out;
+
+	replaced = bench_update(&tree, true, ops, &result);
+	if (result)
+		goto out;
+
+	test_printf(&bench_report, "replace: %lu nodes, %lu updates, ns/update: delete & insert %llu, replace %llu\n",
+		nodes, ops, div64_u64(reinserted, ops), div64_u64(replaced, ops));
+
+out:
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* lookup & delete keys[first, first + count), by match or by the node found, returns the duration in ns */
+static u64 bench_delete_found(struct bench_tree *tree, bool by_node, unsigned long first,
+			      unsigned long count, int *result)
+{
+	struct test_avlrcu_node match;
+	const struct avlrcu_node *found;
+	struct avlrcu_node *node;
+	unsigned long i;
+	u64 start;
+
+	*result = 0;
+	start = ktime_get_ns();
+
+	for (i = first; i < first + count; i++) {
+		match.address = tree->keys[i];
+
+		/* the lookup section lasts until the node is deleted */
+		rcu_read_lock();
+
+		found = avlrcu_search(&tree->root, &match.node);
+		if (!found) {
+			rcu_read_unlock();
+			*result = -ENXIO;
+			break;
+		}
+
+		if (by_node)
+			node = avlrcu_delete_node(&tree->root, found);
+		else
+			node = avlrcu_delete(&tree->root, &match.node);
+
+		rcu_read_unlock();
+
+		if (IS_ERR(node)) {
+			*result = PTR_ERR(node);
+			break;
+		}
+		avlrcu_retire(&tree->root, node);
+
+		if (!(i % BENCH_CHUNK)) {
+			avlrcu_reclaim_throttle(&tree->root);
+			cond_resched();
+		}
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* lookups followed by deletes, half of the keys by match & the other half by node */
+static int bench_delete(unsigned long nodes, unsigned long ops)
+{
+	struct bench_tree tree;
+	u64 by_match, by_node;
+	unsigned long count;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	count = min(ops, nodes / 2);
+	if (!count)
+		goto out;
+
+	by_match = bench_delete_found(&tree, false, 0, count, &result);
+	if (result)
+		goto out;
+
+	by_node = bench_delete_found(&tree, true, count, count, &result);
+	if (result)
+		goto out;
+
+	test_printf(&bench_report, "delete: %lu nodes, %lu deletes, ns/delete: by match %llu, by node %llu\n",
+		nodes, count, div64_u64(by_match, count), div64_u64(by_node, count));
+
+out:
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* deletes with one of the strategies, on a fresh tree (same keys every time) */
+static int bench_delete_strategy(unsigned long nodes, unsigned long count, unsigned int flags,
+				 u64 *duration, unsigned long *copies)
+{
+	struct avlrcu_reclaim_stats before, after;
+	struct bench_tree tree;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	tree.root.flags = flags;
+	avlrcu_reclaim_stats(&tree.root, &before);
+
+	*duration = bench_delete_found(&tree, false, 0, count, &result);
+
+	/* each copy retires the node it replaced */
+	avlrcu_reclaim_stats(&tree.root, &after);
+	*copies = after.retired_nodes - before.retired_nodes;
+
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* deletes by unwind (bubbling to a leaf) & by swap with the in-order neighbour (AVLRCU_DELETE_SWAP) */
+static int bench_swap(unsigned long nodes, unsigned long ops)
+{
+	unsigned long count, unwind_copies, swap_copies;
+	u64 unwind, swap;
+	int result;
+
+	count = min(ops, nodes);
+
+	result = bench_delete_strategy(nodes, count, 0, &unwind, &unwind_copies);
+	if (result)
+		return result;
+
+	result = bench_delete_strategy(nodes, count, AVLRCU_DELETE_SWAP, &swap, &swap_copies);
+	if (result)
+		return result;
+
+	test_printf(&bench_report, "swap: %lu nodes, %lu deletes, ns/delete: unwind %llu, swap %llu, copies/1000 deletes: unwind %lu, swap %lu\n",
+		nodes, count, div64_u64(unwind, count), div64_u64(swap, count),
+		unwind_copies * 1000 / count, swap_copies * 1000 / count);
+
+	return 0;
+}
+
+/* lookups after churn & after packing the top levels in the hot memory */
+static int bench_repack(unsigned long nodes, unsigned long ops)
+{
+	struct bench_tree tree;
+	u64 built, churned, repacked;
+	unsigned long found;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	built = bench_lookups(&tree, ops, &found);
+
+	result = bench_churn(&tree, nodes);
+	if (result)
+		goto out;
+
+	churned = bench_lookups(&tree, ops, &found);
+
+	result = avlrcu_repack(&tree.root);
+	if (result)
+		goto out;
+
+	repacked = bench_lookups(&tree, ops, &found);
+
+	test_printf(&bench_report, "repack: %lu nodes, %lu lookups, %d hot levels, ns/lookup: built %llu, churned %llu, repacked %llu\n",
+		nodes, ops, test_ops.hot_levels, div64_u64(built, ops),
+		div64_u64(churned, ops), div64_u64(repacked, ops));
+
+out:
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* lookups under RCU & outside RCU, then churn with the nodes reclaimed by epochs */
+static int bench_epoch(unsigned long nodes, unsigned long ops)
+{
+	struct bench_tree tree;
+	unsigned long found, found_epoch;
+	u64 rcu, epoch;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	result = avlrcu_epoch_init(&tree.root);
+	if (result)
+		goto out;
+
+	/* the nodes retired while building went to RCU */
+	rcu_barrier();
+
+	rcu = bench_lookups(&tree, ops, &found);
+	epoch = bench_lookups_epoch(&tree, ops, &found_epoch);
+
+	test_printf(&bench_report, "epoch: %lu nodes, %lu lookups, ns/lookup: rcu %llu, epoch %llu\n",
+		nodes, ops, div64_u64(rcu, ops), div64_u64(epoch, ops));
+
+	if (found != found_epoch) {
+		pr_err("%s: found %lu under RCU, %lu outside RCU\n", __func__, found, found_epoch);
+		result = -EINVAL;
+		goto out;
+	}
+
+	result = bench_churn(&tree, nodes);
+
+out:
+	bench_destroy(&tree);
+
+	return result;
+}
+
+/* objects with a large payload, embedded in the tree or linked */
+#define BENCH_PAYLOAD	512
+
+struct bench_object {
+	unsigned long key;
+	struct rcu_head rcu;
+	char data[BENCH_PAYLOAD];
+	struct avlrcu_node node;
+};
+
+DEFINE_AVLRCU_TREE(bench_embedded, struct bench_object, node, key, avlrcu_key_int)
+DEFINE_AVLRCU_LINK_TREE(bench_linked, struct bench_object, rcu, key, avlrcu_key_int)
+
+/* replace random keys of the embedded tree, returns the duration in ns */
+static u64 bench_churn_embedded(struct avlrcu_root *root, unsigned long *keys, unsigned long count,
+				unsigned long updates, int *result)
+{
+	struct bench_object *obj;
+	u64 state = ~BENCH_SEED;
+	unsigned long i, index;
+	u64 start;
+
+	*result = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < updates && !*result; i++) {
+		index = bench_rand(&state) % count;
+
+		obj = bench_embedded_delete(root, &keys[index]);
+		if (IS_ERR(obj)) {
+			*result = PTR_ERR(obj);
+			break;
+		}
+
+		/* readers may still see the object, insert a new one */
+		avlrcu_retire(root, &obj->node);
+
+		obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+		if (!obj) {
+			*result = -ENOMEM;
+			break;
+		}
+
+		do {
+			keys[index] = bench_rand(&state) | 1;
+			obj->key = keys[index];
+			*result = bench_embedded_insert(root, obj);
+		} while (*result == -EEXIST);
+
+		if (*result)
+			kfree(obj);
+
+		if (!(i % BENCH_CHUNK)) {
+			avlrcu_reclaim_throttle(root);
+			cond_resched();
+		}
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* same updates on the linked tree */
+static u64 bench_churn_linked(struct avlrcu_root *root, unsigned long *keys, unsigned long count,
+			      unsigned long updates, int *result)
+{
+	struct bench_object *obj;
+	u64 state = ~BENCH_SEED;
+	unsigned long i, index;
+	u64 start;
+
+	*result = 0;
+	start = ktime_get_ns();
+
+	for (i = 0; i < updates && !*result; i++) {
+		index = bench_rand(&state) % count;
+
+		obj = bench_linked_delete(root, &keys[index]);
+		if (IS_ERR(obj)) {
+			*result = PTR_ERR(obj);
+			break;
+		}
+
+		/* readers may still see the payload, insert a new one */
+		bench_linked_release(obj);
+
+		obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+		if (!obj) {
+			*result = -ENOMEM;
+			break;
+		}
+
+		do {
+			keys[index] = bench_rand(&state) | 1;
+			obj->key = keys[index];
+			*result = bench_linked_insert(root, obj);
+		} while (*result == -EEXIST);
+
+		if (*result)
+			kfree(obj);
+
+		if (!(i % BENCH_CHUNK)) {
+			avlrcu_reclaim_throttle(root);
+			cond_resched();
+		}
+	}
+
+	return ktime_get_ns() - start;
+}
+
+/* updates on large objects, embedded in the nodes (copied whole) & linked (only the link copied) */
+static int bench_link(unsigned long nodes, unsigned long ops)
+{
+	struct avlrcu_root embedded, linked;
+	struct bench_object *obj;
+	unsigned long *keys[2];
+	unsigned long i;
+	u64 copied, shared;
+	int result = 0;
+
+	keys[0] = kvmalloc_array(nodes, sizeof(unsigned long), GFP_KERNEL);
+	keys[1] = kvmalloc_array(nodes, sizeof(unsigned long), GFP_KERNEL);
+	if (!keys[0] || !keys[1]) {
+		kvfree(keys[0]);
+		kvfree(keys[1]);
+		return -ENOMEM;
+	}
+
+	bench_embedded_init(&embedded);
+	bench_linked_init(&linked);
+	embedded.reclaim.high_water = BENCH_HIGH_WATER;
+	linked.reclaim.high_water = BENCH_HIGH_WATER;
+
+	for (i = 0; i < nodes && !result; i++) {
+		/* odd keys, the churn replaces them with random odd keys */
+		keys[0][i] = keys[1][i] = 2 * i + 1;
+
+		obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+		if (!obj) {
+			result = -ENOMEM;
+			break;
+		}
+		obj->key = keys[0][i];
+
+		result = bench_embedded_insert(&embedded, obj);
+		if (result) {
+			kfree(obj);
+			break;
+		}
+
+		obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+		if (!obj) {
+			result = -ENOMEM;
+			break;
+		}
+		obj->key = keys[1][i];
+
+		result = bench_linked_insert(&linked, obj);
+		if (result)
+			kfree(obj);
+
+		if (!(i % BENCH_CHUNK))
+			cond_resched();
+	}
+
+	if (result)
+		goto out;
+
+	copied = bench_churn_embedded(&embedded, keys[0], nodes, ops, &result);
+	if (result)
+		goto out;
+
+	shared = bench_churn_linked(&linked, keys[1], nodes, ops, &result);
+	if (result)
+		goto out;
+
+	test_printf(&bench_report, "link: %lu nodes, %lu updates, %d bytes payload, ns/update: embedded %llu, linked %llu\n",
+		nodes, ops, BENCH_PAYLOAD, div64_u64(copied, ops), div64_u64(shared, ops));
+
+out:
+	bench_linked_free(&linked);
+	kvfree(keys[0]);
+	kvfree(keys[1]);
+	test_destroy(&embedded);
+
+	return result;
+}
+
+/* lookups through the ops & through the typed calls, on trees with the same keys */
+static int bench_typed(unsigned long nodes, unsigned long ops)
+{
+	struct test_avlrcu_node *container;
+	struct avlrcu_root typed;
+	struct bench_tree tree;
+	unsigned long found, found_typed;
+	unsigned long i, key;
+	u64 plain, inlined;
+	int result;
+
+	result = bench_build(&tree, nodes);
+	if (result)
+		return result;
+
+	bench_typed_init(&typed);
+	for (i = 0; i < tree.count; i++) {
+		container = kzalloc(sizeof(*container), GFP_KERNEL);
+		if (!container) {
+			result = -ENOMEM;
+			goto out;
+		}
+
+		container->address = tree.keys[i];
+		result = bench_typed_insert(&typed, container);
+		if (result) {
+			kfree(container);
+			goto out;
+		}
+
+		if (!(i % BENCH_CHUNK))
+			cond_resched();
+	}
+
+	plain = bench_lookups(&tree, ops, &found);
+	inlined = bench_lookups_typed(&tree, &typed, ops, &found_typed);
+
+	test_printf(&bench_report, "typed: %lu nodes, %lu lookups, ns/lookup: ops %llu, typed %llu\n",
+		nodes, ops, div64_u64(plain, ops), div64_u64(inlined, ops));
+
+	if (found != found_typed) {
+		pr_err("%s: found %lu through the ops, %lu typed\n", __func__, found, found_typed);
+		result = -EINVAL;
+		goto out;
+	}
+
+	/* the in-order walk & the lower bounds agree, the keys are never 0 */
+	rcu_read_lock();
+	key = 0;
+	for (container = bench_typed_first(&typed); container; container = bench_typed_next(container)) {
+		if (bench_typed_lower_bound(&typed, &key) != container) {
+			pr_err("%s: wrong lower bound for %lx\n", __func__, key);
+			result = -EINVAL;
+			break;
+		}
+		key = container->address + 1;
+	}
+	rcu_read_unlock();
+
+	/* exercise the delete path */
+	for (i = 0; i < tree.count && !result; i++) {
+		container = bench_typed_delete(&typed, &tree.keys[i]);
+		if (IS_ERR(container)) {
+			result = PTR_ERR(container);
+			break;
+		}
+		avlrcu_retire(&typed, &container->node);
+
+		if (!(i % BENCH_CHUNK))
+			cond_resched();
+	}
+
+out:
+	avlrcu_free(&typed);
+	bench_destroy(&tree);
+
+	return result;
+}
+
+struct bench_mode {
+	const char *name;
+	int (*run)(unsigned long nodes, unsigned long ops);
+};
+
+static const struct bench_mode bench_modes[] = {
+	{ "search", bench_search },
+	{ "repack", bench_repack },
+	{ "batch", bench_batch },
+	{ "cache", bench_cache },
+	{ "finger", bench_finger },
+	{ "frozen", bench_frozen },
+	{ "fat", bench_fat },
+	{ "epoch", bench_epoch },
+	{ "typed", bench_typed },
+	{ "link", bench_link },
+	{ "replace", bench_replace },
+	{ "delete", bench_delete },
+	{ "swap", bench_swap },
+};
+
+/* input: <mode> <nodes> <ops> */
+static ssize_t bench_write(struct file *file, const char __user *data, size_t count, loff_t *offs)
+{
+	char buf[64], name[16];
+	unsigned long nodes, ops;
+	int i, result;
+
+	if (count >= sizeof(buf))
+		return -E2BIG;
+
+	memset(buf, 0, sizeof(buf));
+	if (copy_from_user(buf, data, count))
+		return -EFAULT;
+
+	if (sscanf(buf, "%15s %lu %lu", name, &nodes, &ops) != 3)
+		return -EINVAL;
+
+	if (nodes == 0 || ops == 0)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(bench_modes); i++)
+		if (!strcmp(name, bench_modes[i].name))
+			break;
+
+	if (i == ARRAY_SIZE(bench_modes))
+		return -EINVAL;
+
+	mutex_lock(&bench_report.lock);
+
+	bench_report.len = 0;
+	result = bench_modes[i].run(nodes, ops);
+
+	mutex_unlock(&bench_report.lock);
+
+	if (result)
+		return result;
+
+	*offs += count;
+	return count;
+}
+
+static struct file_operations bench_map_ops = {
+	.owner = THIS_MODULE,
+	.open = test_report_open,
+	.read = seq_read,
+	.write = bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+struct dentry *bench_debugfs_init(struct dentry *dir)
+{
+	return debugfs_create_file("bench", S_IRUGO | S_IWUGO, dir, &bench_report, &bench_map_ops);
+}
@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/irqflags.h>
+#include <linux/rcupdate.h>
+
+#include "internal.h"
+
+/*
+ * Direct-mapped cache of recent lookups, one per CPU.
+ *
+ * Each entry is tagged with the tree it was found in & its generation:
+ * the generations of different trees are unrelated, a cache shared by
+ * several trees must not return a node of one for another.
+ * Updates bump the generation after publishing the new version of the tree
+ * & before retiring the replaced nodes, so an entry tagged with the current
+ * generation points to a node that can't be freed during the reader's RCU section.
+ * Any update invalidates all the entries.
+ *
+ * The argument holds for RCU readers only: trees with epoch based reclamation
+ * (readers outside RCU) are not cached, the lookups go straight to the tree.
+ */
+struct avlrcu_cache_slot {
+	const struct avlrcu_root *root;
+	unsigned long gen;
+	const struct avlrcu_node *node;
+};
+
+struct avlrcu_cache_cpu {
+	struct avlrcu_cache_slot slot[AVLRCU_CACHE_SLOTS];
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/**
+ * avlrcu_cache_init() - allocate a lookup cache
+ * @cache	the cache
+ * @hash	returns the key of the object (mixed by the cache)
+ *
+ * The cache can be used in front of any tree with objects that share the same key,
+ * several trees may share it (their entries evict each other).
+ *
+ * Returns 0 on success or -ENOMEM.
+ */
+int avlrcu_cache_init(struct avlrcu_cache *cache, unsigned long (*hash)(const struct avlrcu_node *))
+{
+	cache->hash = hash;
+	cache->cpu = alloc_percpu(struct avlrcu_cache_cpu);
+	if (!cache->cpu)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* the readers using the cache must be done */
+void avlrcu_cache_free(struct avlrcu_cache *cache)
+{
+	free_percpu(cache->cpu);
+	cache->cpu = NULL;
+}
+
+void avlrcu_cache_stats(struct avlrcu_cache *cache, unsigned long *hits, unsigned long *misses)
+{
+	struct avlrcu_cache_cpu *cpu;
+	int i;
+
+	*hits = 0;
+	*misses = 0;
+
+	for_each_possible_cpu(i) {
+		cpu = per_cpu_ptr(cache->cpu, i);
+		*hits += READ_ONCE(cpu->hits);
+		*misses += READ_ONCE(cpu->misses);
+	}
+}
+
+/**
+ * avlrcu_search_cached() - search for an object, looking first in the cache
+ * @root	root of the tree
+ * @cache	the cache in front of the tree
+ * @match	node to match against
+ *
+ * Same semantics as avlrcu_search(). Only the matches are cached.
+ * The slots of the current CPU are accessed with the interrupts disabled,
+ * lookups from interrupt context may use the same cache.
+ * On a tree with epoch based reclamation the cache is bypassed (not counted),
+ * the call is a plain avlrcu_search(), under RCU.
+ */
+const struct avlrcu_node *avlrcu_search_cached(const struct avlrcu_root *root, struct avlrcu_cache *cache,
+					       const struct avlrcu_node *match)
+{
+	struct avlrcu_cache_slot *slot;
+	struct avlrcu_cache_cpu *cpu;
+	const struct avlrcu_node *node;
+	unsigned long gen, flags;
+	u32 index;
+
+	/* the generation tags assume RCU readers, see above */
+	if (root->epoch)
+		return avlrcu_search(root, match);
+
+	index = hash_long(cache->hash(match), AVLRCU_CACHE_BITS);
+
+	/* the search below sees this generation of the tree or a newer one */
+	gen = smp_load_acquire(&root->gen);
+
+	local_irq_save(flags);
+
+	cpu = this_cpu_ptr(cache->cpu);
+	slot = &cpu->slot[index];
+	node = slot->node;
+
+	if (node && slot->root == root && slot->gen == gen && root->ops->cmp(match, node) == 0) {
+		cpu->hits++;
+		local_irq_restore(flags);
+		return node;
+	}
+
+	cpu->misses++;
+	local_irq_restore(flags);
+
+	node = avlrcu_search(root, match);
+	if (!node)
+		return NULL;
+
+	local_irq_save(flags);
+
+	slot = &this_cpu_ptr(cache->cpu)->slot[index];
+	slot->root = root;
+	slot->gen = gen;
+	slot->node = node;
+
+	local_irq_restore(flags);
+
+	return node;
+}
@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/llist.h>
+#include <linux/seqlock.h>
+
+#include "internal.h"
+
+/*
+ * Epoch based reclamation, for readers that can't use RCU.
+ *
+ * Readers announce themselves on per-CPU counters of the parity of the epoch
+ * they started in (like SRCU, the enter & exit counts are kept apart, so a
+ * reader may exit on another CPU). They never wait for anything.
+ *
+ * Retired nodes go on the limbo list of the current epoch. The writer moves
+ * to the next epoch when there are no readers left in the previous one.
+ * By then, the readers that could have seen the nodes retired two epochs ago
+ * are gone & the nodes get posted to RCU (ops->free_rcu()): the tree may
+ * still have RCU readers (avlrcu_search() & co.), those don't count on epochs.
+ * All of this happens on the write side, under the lock.
+ *
+ * Checking for the readers sums the counters of every possible CPU (twice),
+ * so the writer tries to advance only once per EPOCH_ADVANCE_NODES retired
+ * nodes, not on every update.
+ */
+#define EPOCH_ADVANCE_NODES	64
+
+struct avlrcu_epoch_cpu {
+	unsigned long enter[2];
+	unsigned long exit[2];
+};
+
+struct avlrcu_epoch {
+	unsigned long epoch;
+	unsigned long retired;		/* nodes retired since the last try to advance */
+	struct avlrcu_epoch_cpu __percpu *cpu;
+	struct llist_head limbo[3];	/* nodes retired in epoch % 3 */
+};
+
+/**
+ * avlrcu_epoch_init() - switch a tree to epoch based reclamation
+ * @root	root of the tree
+ *
+ * Must be called before readers outside RCU start using the tree.
+ * Nodes retired before the switch are still posted to RCU, wait for them
+ * with rcu_barrier() if the tree was already in use.
+ *
+ * Returns 0 on success or -ENOMEM.
+ */
+int avlrcu_epoch_init(struct avlrcu_root *root)
+{
+	struct avlrcu_epoch *ep;
+
+	ep = kzalloc(sizeof(*ep), GFP_KERNEL);
+	if (!ep)
+		return -ENOMEM;
+
+	ep->cpu = alloc_percpu(struct avlrcu_epoch_cpu);
+	if (!ep->cpu) {
+		kfree(ep);
+		return -ENOMEM;
+	}
+
+	root->epoch = ep;
+
+	return 0;
+}
+
+/* the epoch readers are gone, the RCU readers get a grace period */
+static void epoch_free_limbo(struct avlrcu_root *root, struct llist_head *limbo)
+{
+	struct avlrcu_node *node, *temp;
+	long count = 0;
+
+	llist_for_each_entry_safe(node, temp, __llist_del_all(limbo), old) {
+		root->ops->free_rcu(node);
+		count++;
+	}
+
+	reclaim_posted(root, count);
+}
+
+/**
+ * avlrcu_epoch_destroy() - free the nodes in limbo & the epoch state
+ * @root	root of the tree
+ *
+ * The epoch readers must be done with the tree. Call after avlrcu_free().
+ * The nodes are posted to RCU, like the nodes of the tree.
+ */
+void avlrcu_epoch_destroy(struct avlrcu_root *root)
+{
+	struct avlrcu_epoch *ep = root->epoch;
+	int i;
+
+	if (!ep)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(ep->limbo); i++)
+		epoch_free_limbo(root, &ep->limbo[i]);
+
+	free_percpu(ep->cpu);
+	kfree(ep);
+	root->epoch = NULL;
+}
+
+/**
+ * avlrcu_epoch_enter() - start a read-side section outside RCU
+ * @root	root of the tree, switched to epoch based reclamation
+ *
+ * Never blocks. The nodes seen during the section stay allocated until
+ * avlrcu_epoch_exit(). Sections may nest & may be preempted.
+ *
+ * Returns the index to pass to avlrcu_epoch_exit().
+ */
+int avlrcu_epoch_enter(const struct avlrcu_root *root)
+{
+	struct avlrcu_epoch *ep = root->epoch;
+	int idx;
+
+	idx = READ_ONCE(ep->epoch) & 1;
+	this_cpu_inc(ep->cpu->enter[idx]);
+
+	/* pairs with the barrier in epoch_advance(), the count before the loads of the tree */
+	smp_mb();
+
+	return idx;
+}
+
+void avlrcu_epoch_exit(const struct avlrcu_root *root, int idx)
+{
+	struct avlrcu_epoch *ep = root->epoch;
+
+	/* the loads of the tree before the count */
+	smp_mb();
+
+	this_cpu_inc(ep->cpu->exit[idx]);
+}
+
+/* are all the readers that entered with this parity gone ? */
+static bool epoch_readers_gone(struct avlrcu_epoch *ep, int idx)
+{
+	unsigned long enter = 0, exit = 0;
+	int cpu;
+
+	/* the exits first, a reader counted on exit is counted on enter too */
+	for_each_possible_cpu(cpu)
+		exit += READ_ONCE(per_cpu_ptr(ep->cpu, cpu)->exit[idx]);
+
+	smp_mb();
+
+	for_each_possible_cpu(cpu)
+		enter += READ_ONCE(per_cpu_ptr(ep->cpu, cpu)->enter[idx]);
+
+	return enter == exit;
+}
+
+/*
+ * A reader holding a node retired in epoch e entered in e or e - 1, before the
+ * node got unlinked. Readers that entered late, after their counters were seen
+ * empty, also see the node unlinked (barriers). So once the readers of e are
+ * gone (checked when moving to e + 2), the nodes of e can be freed.
+ */
+static void epoch_advance(struct avlrcu_root *root)
+{
+	struct avlrcu_epoch *ep = root->epoch;
+	unsigned long epoch = ep->epoch;
+
+	ep->retired = 0;
+
+	/* pairs with the barrier in avlrcu_epoch_enter(), the unlinking before the counts */
+	smp_mb();
+
+	/* the readers of the previous epoch, same parity as the next one */
+	if (!epoch_readers_gone(ep, (epoch + 1) & 1))
+		return;
+
+	/* the limbo of the previous epoch, reused by the next one */
+	epoch_free_limbo(root, &ep->limbo[(epoch + 2) % 3]);
+
+	smp_store_release(&ep->epoch, epoch + 1);
+}
+
+/*
+ * epoch_retire() - retire unlinked nodes to the current epoch
+ * @root	root of the tree
+ * @first	chain of retired nodes (linked by node->old)
+ *
+ * Returns true if the tree uses epoch based reclamation & the nodes were taken,
+ * false if the caller must post them to RCU.
+ */
+bool epoch_retire(struct avlrcu_root *root, struct llist_node *first)
+{
+	struct avlrcu_epoch *ep = root->epoch;
+	struct llist_node *last;
+
+	if (!ep)
+		return false;
+
+	if (first) {
+		ep->retired++;
+		for (last = first; last->next; last = last->next)
+			ep->retired++;
+
+		__llist_add_batch(first, last, &ep->limbo[ep->epoch % 3]);
+	}
+
+	if (ep->retired >= EPOCH_ADVANCE_NODES)
+		epoch_advance(root);
+
+	return true;
+}
+
+/**
+ * avlrcu_epoch_reclaim() - try to free the nodes in limbo
+ * @root	root of the tree
+ *
+ * This is a write-side call and must be protected by a lock.
+ * Updates do this on their own, every EPOCH_ADVANCE_NODES retired nodes;
+ * call it when there are no more updates.
+ * Each call frees at most the nodes of one epoch, it takes two calls
+ * without readers in between to free the nodes retired by the last update.
+ */
+void avlrcu_epoch_reclaim(struct avlrcu_root *root)
+{
+	if (root->epoch)
+		epoch_advance(root);
+}
+
+/**
+ * avlrcu_retire() - free a node removed from the tree when no reader can see it
+ * @root	root of the tree
+ * @node	the node returned by avlrcu_delete()
+ *
+ * This is a write-side call and must be protected by a lock.
+ * Uses the reclamation of the tree, epochs then RCU, or RCU only (ops->free_rcu()).
+ */
+void avlrcu_retire(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+	node->old.next = NULL;
+
+	if (!epoch_retire(root, &node->old))
+		root->ops->free_rcu(node);
+}
+
+/**
+ * avlrcu_search_seq() - search for an object in the tree, outside RCU
+ * @root	root of the tree
+ * @match	node to match against
+ *
+ * Must be protected by avlrcu_epoch_enter() & avlrcu_epoch_exit(), or by RCU section.
+ * Same semantics as avlrcu_search(), except the search is retried if it
+ * overlapped the publishing of an update, so the result belongs to the version
+ * of the tree that was current when the search ended.
+ * The retry only picks the version, the section keeps the nodes allocated.
+ * The publishing is short & done with preemption disabled, the readers spin on it.
+ */
+const struct avlrcu_node *avlrcu_search_seq(const struct avlrcu_root *root, const struct avlrcu_node *match)
+{
+	const struct avlrcu_node *node;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&root->seq);
+		node = avlrcu_search(root, match);
+	} while (read_seqcount_retry(&root->seq, seq));
+
+	return node;
+}
@@ -0,0 +1,463 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/limits.h>
+#include <linux/rcupdate.h>
+
+#include "fat.h"
+
+#ifdef AVLRCU_DEBUG
+#define ASSERT(_expr) BUG_ON(!(_expr))
+#else /* AVLRCU_DEBUG */
+#define ASSERT(_expr)
+#endif /* AVLRCU_DEBUG */
+
+/*
+ * Internal nodes: slots[i] holds the keys < keys[i] (and >= keys[i - 1]).
+ * Leaves: slots[i] holds the value of keys[i].
+ *
+ * Deletions don't merge nodes. Empty leaves get removed & an internal node
+ * left with a single child gets replaced by the child, so the leaves
+ * may end up on different levels. Searches & updates don't care.
+ */
+
+/* context for insert/delete operations */
+struct fat_ctxt {
+	struct avlrcu_fat_root *root;
+	struct llist_head old;		/* nodes replaced by the new path */
+	struct llist_head pool;		/* nodes reserved before building the new path */
+
+	/* internal nodes from the root to the leaf & the slot taken on each */
+	struct avlrcu_fat_node *path[AVLRCU_FAT_MAX_HEIGHT];
+	int index[AVLRCU_FAT_MAX_HEIGHT];
+	int depth;
+};
+
+/* result of rebuilding a level, passed to the level above */
+struct fat_carry {
+	struct avlrcu_fat_node *left;	/* replaces the old node, NULL if it was removed */
+	struct avlrcu_fat_node *right;	/* new sibling after a split */
+	u64 separator;			/* first key of the sibling */
+};
+
+void avlrcu_fat_init(struct avlrcu_fat_root *root)
+{
+	root->root = NULL;
+}
+
+static void fat_ctxt_init(struct fat_ctxt *ctxt, struct avlrcu_fat_root *root)
+{
+	ctxt->root = root;
+	init_llist_head(&ctxt->old);
+	init_llist_head(&ctxt->pool);
+	ctxt->depth = 0;
+}
+
+static void fat_unreserve(struct fat_ctxt *ctxt)
+{
+	struct avlrcu_fat_node *node, *temp;
+	struct llist_node *first;
+
+	first = __llist_del_all(&ctxt->pool);
+	llist_for_each_entry_safe(node, temp, first, old)
+		kfree(node);
+}
+
+/* reserve all the nodes of the new path, building it must not fail */
+static int fat_reserve(struct fat_ctxt *ctxt, int count)
+{
+	struct avlrcu_fat_node *node;
+
+	while (count--) {
+		node = kmalloc(sizeof(*node), GFP_ATOMIC);
+		if (!node) {
+			fat_unreserve(ctxt);
+			return -ENOMEM;
+		}
+
+		__llist_add(&node->old, &ctxt->pool);
+	}
+
+	return 0;
+}
+
+static struct avlrcu_fat_node *fat_alloc(struct fat_ctxt *ctxt)
+{
+	struct llist_node *first = ctxt->pool.first;
+
+	ASSERT(first);
+	ctxt->pool.first = first->next;
+
+	return llist_entry(first, struct avlrcu_fat_node, old);
+}
+
+static void fat_retire(struct fat_ctxt *ctxt, struct avlrcu_fat_node *node)
+{
+	__llist_add(&node->old, &ctxt->old);
+}
+
+/* post the replaced nodes to RCU, after the new path was published */
+static void fat_remove_old(struct fat_ctxt *ctxt)
+{
+	struct avlrcu_fat_node *node, *temp;
+	struct llist_node *first;
+
+	first = __llist_del_all(&ctxt->old);
+	llist_for_each_entry_safe(node, temp, first, old)
+		kfree_rcu(node, rcu);
+}
+
+/*
+ * The keys of a node are compared all at once, without branches: the rank
+ * is a sum of comparison results over all the slots, the unused ones are
+ * padded with U64_MAX. The fixed trip count gets unrolled into cmp/setcc
+ * sequences, there's no loop exit to mispredict.
+ */
+
+/* slot of the child that may contain the key (number of keys <= key) */
+static int fat_child_index(const struct avlrcu_fat_node *node, u64 key)
+{
+	int i, rank = 0;
+
+	for (i = 0; i < AVLRCU_FAT_KEYS; i++)
+		rank += key >= node->keys[i];
+
+	/* the padding counts for key U64_MAX */
+	return min_t(int, rank, node->count);
+}
+
+/* position of the first key >= key (number of keys < key) */
+static int fat_leaf_index(const struct avlrcu_fat_node *leaf, u64 key)
+{
+	int i, rank = 0;
+
+	for (i = 0; i < AVLRCU_FAT_KEYS; i++)
+		rank += key > leaf->keys[i];
+
+	return rank;
+}
+
+/* record the path to the leaf that may contain the key */
+static struct avlrcu_fat_node *fat_descend(struct fat_ctxt *ctxt, u64 key)
+{
+	struct avlrcu_fat_node *node = ctxt->root->root;
+	int i;
+
+	while (node && !node->leaf) {
+		ASSERT(ctxt->depth < AVLRCU_FAT_MAX_HEIGHT);
+
+		i = fat_child_index(node, key);
+		ctxt->path[ctxt->depth] = node;
+		ctxt->index[ctxt->depth] = i;
+		ctxt->depth++;
+
+		node = node->slots[i];
+	}
+
+	return node;
+}
+
+static struct avlrcu_fat_node *fat_fill(struct fat_ctxt *ctxt, bool leaf, const u64 *keys, int count, void **slots)
+{
+	struct avlrcu_fat_node *node = fat_alloc(ctxt);
+	int i;
+
+	ASSERT(count <= AVLRCU_FAT_KEYS);
+
+	node->leaf = leaf;
+	node->count = count;
+	memcpy(node->keys, keys, count * sizeof(u64));
+	for (i = count; i < AVLRCU_FAT_KEYS; i++)
+		node->keys[i] = U64_MAX;
+	memcpy(node->slots, slots, (leaf ? count : count + 1) * sizeof(void *));
+
+	return node;
+}
+
+/* new leaf, or two if the keys don't fit */
+static struct fat_carry fat_build_leaf(struct fat_ctxt *ctxt, const u64 *keys, int count, void **values)
+{
+	struct fat_carry carry = { };
+	int split;
+
+	if (count <= AVLRCU_FAT_KEYS) {
+		carry.left = fat_fill(ctxt, true, keys, count, values);
+		return carry;
+	}
+
+	split = count / 2;
+	carry.left = fat_fill(ctxt, true, keys, split, values);
+	carry.right = fat_fill(ctxt, true, keys + split, count - split, values + split);
+	carry.separator = keys[split];
+
+	return carry;
+}
+
+/* new internal node, or two if the keys don't fit (the middle key moves up) */
+static struct fat_carry fat_build_internal(struct fat_ctxt *ctxt, const u64 *keys, int count, void **children)
+{
+	struct fat_carry carry = { };
+	int split;
+
+	if (count <= AVLRCU_FAT_KEYS) {
+		carry.left = fat_fill(ctxt, false, keys, count, children);
+		return carry;
+	}
+
+	split = count / 2;
+	carry.left = fat_fill(ctxt, false, keys, split, children);
+	carry.right = fat_fill(ctxt, false, keys + split + 1, count - split - 1, children + split + 1);
+	carry.separator = keys[split];
+
+	return carry;
+}
+
+/* copy an internal node with the changes of the child at slot i */
+static struct fat_carry fat_update_internal(struct fat_ctxt *ctxt, struct avlrcu_fat_node *node, int i,
+					    const struct fat_carry *child)
+{
+	u64 keys[AVLRCU_FAT_KEYS + 1];
+	void *children[AVLRCU_FAT_KEYS + 2];
+	struct fat_carry carry = { };
+	int count = node->count;
+
+	memcpy(keys, node->keys, count * sizeof(u64));
+	memcpy(children, node->slots, (count + 1) * sizeof(void *));
+
+	/* the child was removed, so is the key separating it from a neighbour */
+	if (!child->left) {
+		ASSERT(count > 0);
+
+		/* a single child left takes the place of the node */
+		if (count == 1) {
+			carry.left = children[1 - i];
+			return carry;
+		}
+
+		memmove(keys + (i ? i - 1 : 0), keys + (i ? i : 1), (count - (i ? i : 1)) * sizeof(u64));
+		memmove(children + i, children + i + 1, (count - i) * sizeof(void *));
+
+		return fat_build_internal(ctxt, keys, count - 1, children);
+	}
+
+	children[i] = child->left;
+	if (!child->right)
+		return fat_build_internal(ctxt, keys, count, children);
+
+	/* the child was split, insert the separator & the sibling */
+	memmove(keys + i + 1, keys + i, (count - i) * sizeof(u64));
+	memmove(children + i + 2, children + i + 1, (count - i) * sizeof(void *));
+	keys[i] = child->separator;
+	children[i + 1] = child->right;
+
+	return fat_build_internal(ctxt, keys, count + 1, children);
+}
+
+/* rebuild the path above the leaf & publish it */
+static void fat_connect(struct fat_ctxt *ctxt, struct fat_carry carry)
+{
+	struct avlrcu_fat_node *node;
+	void *children[2];
+	int level;
+
+	for (level = ctxt->depth - 1; level >= 0; level--) {
+		node = ctxt->path[level];
+		carry = fat_update_internal(ctxt, node, ctxt->index[level], &carry);
+		fat_retire(ctxt, node);
+	}
+
+	/* the root was split, the tree grows */
+	if (carry.right) {
+		children[0] = carry.left;
+		children[1] = carry.right;
+		carry = fat_build_internal(ctxt, &carry.separator, 1, children);
+	}
+
+	rcu_assign_pointer(ctxt->root->root, carry.left);
+}
+
+/**
+ * avlrcu_fat_insert() - insert a value in the tree
+ * @root	root of the tree
+ * @key		key of the value
+ * @value	the value, can't be NULL
+ *
+ * Returns 0 on success, -EEXIST if the key is already in the tree or -ENOMEM.
+ * On error, the tree is not modified.
+ */
+int avlrcu_fat_insert(struct avlrcu_fat_root *root, u64 key, void *value)
+{
+	struct fat_carry carry;
+	struct avlrcu_fat_node *leaf;
+	u64 keys[AVLRCU_FAT_KEYS + 1];
+	void *values[AVLRCU_FAT_KEYS + 1];
+	struct fat_ctxt ctxt;
+	int count, pos;
+	int result;
+
+	ASSERT(value);
+
+	fat_ctxt_init(&ctxt, root);
+
+	leaf = fat_descend(&ctxt, key);
+	pos = leaf ? fat_leaf_index(leaf, key) : 0;
+	count = leaf ? leaf->count : 0;
+
+	if (pos < count && leaf->keys[pos] == key)
+		return -EEXIST;
+
+	/* the tree grows by one level at most */
+	if (ctxt.depth + 1 >= AVLRCU_FAT_MAX_HEIGHT)
+		return -ENOMEM;
+
+	/* each level may split, plus a new root */
+	result = fat_reserve(&ctxt, 2 * (ctxt.depth + 1) + 1);
+	if (result)
+		return result;
+
+	if (leaf) {
+		memcpy(keys, leaf->keys, pos * sizeof(u64));
+		memcpy(values, leaf->slots, pos * sizeof(void *));
+		memcpy(keys + pos + 1, leaf->keys + pos, (count - pos) * sizeof(u64));
+		memcpy(values + pos + 1, leaf->slots + pos, (count - pos) * sizeof(void *));
+		fat_retire(&ctxt, leaf);
+	}
+
+	keys[pos] = key;
+	values[pos] = value;
+
+	carry = fat_build_leaf(&ctxt, keys, count + 1, values);
+	fat_connect(&ctxt, carry);
+
+	fat_unreserve(&ctxt);
+	fat_remove_old(&ctxt);
+
+	return 0;
+}
+
+/**
+ * avlrcu_fat_delete() - delete a value from the tree
+ * @root	root of the tree
+ * @key		key of the value
+ *
+ * The value may still be used by readers, it's the duty of the user
+ * to free it after waiting for a grace period to elapse.
+ *
+ * Returns:	the value on success
+ *		-ENXIO - key was not found
+ *		-ENOMEM - allocations failed
+ *
+ * On error, the tree is not modified.
+ */
+void *avlrcu_fat_delete(struct avlrcu_fat_root *root, u64 key)
+{
+	struct fat_carry carry = { };
+	struct avlrcu_fat_node *leaf;
+	u64 keys[AVLRCU_FAT_KEYS];
+	void *values[AVLRCU_FAT_KEYS];
+	struct fat_ctxt ctxt;
+	void *value;
+	int count, pos;
+	int result;
+
+	fat_ctxt_init(&ctxt, root);
+
+	leaf = fat_descend(&ctxt, key);
+	if (!leaf)
+		return ERR_PTR(-ENXIO);
+
+	pos = fat_leaf_index(leaf, key);
+	count = leaf->count;
+	if (pos == count || leaf->keys[pos] != key)
+		return ERR_PTR(-ENXIO);
+
+	/* each level gets copied once */
+	result = fat_reserve(&ctxt, ctxt.depth + 1);
+	if (result)
+		return ERR_PTR(result);
+
+	value = leaf->slots[pos];
+
+	/* an empty leaf gets removed */
+	if (count > 1) {
+		memcpy(keys, leaf->keys, pos * sizeof(u64));
+		memcpy(values, leaf->slots, pos * sizeof(void *));
+		memcpy(keys + pos, leaf->keys + pos + 1, (count - pos - 1) * sizeof(u64));
+		memcpy(values + pos, leaf->slots + pos + 1, (count - pos - 1) * sizeof(void *));
+
+		carry = fat_build_leaf(&ctxt, keys, count - 1, values);
+	}
+
+	fat_retire(&ctxt, leaf);
+	fat_connect(&ctxt, carry);
+
+	fat_unreserve(&ctxt);
+	fat_remove_old(&ctxt);
+
+	return value;
+}
+
+static void fat_free_subtree(struct avlrcu_fat_node *node)
+{
+	int i;
+
+	if (!node->leaf)
+		for (i = 0; i <= node->count; i++)
+			fat_free_subtree(node->slots[i]);
+
+	kfree_rcu(node, rcu);
+}
+
+/**
+ * avlrcu_fat_free() - deletes all the nodes in the tree
+ * @root	root of the tree
+ *
+ * All nodes are posted to RCU for deletion, the values belong to the user.
+ * The recursion is bounded by AVLRCU_FAT_MAX_HEIGHT.
+ */
+void avlrcu_fat_free(struct avlrcu_fat_root *root)
+{
+	struct avlrcu_fat_node *node = root->root;
+
+	rcu_assign_pointer(root->root, NULL);
+
+	if (node)
+		fat_free_subtree(node);
+}
+
+/**
+ * avlrcu_fat_search() - search for a value in the tree
+ * @root	root of the tree
+ * @key		key of the value
+ *
+ * Returns the value or NULL.
+ */
+void *avlrcu_fat_search(const struct avlrcu_fat_root *root, u64 key)
+{
+	const struct avlrcu_fat_node *node;
+	int i;
+
+	node = rcu_access_pointer(root->root);
+	if (!node)
+		return NULL;
+
+	while (!node->leaf)
+		node = rcu_access_pointer(node->slots[fat_child_index(node, key)]);
+
+	i = fat_leaf_index(node, key);
+	if (i < node->count && node->keys[i] == key)
+		return rcu_access_pointer(node->slots[i]);
+
+	return NULL;
+}
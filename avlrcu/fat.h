@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _AVLRCU_FAT_H_
+#define _AVLRCU_FAT_H_
+
+#include <linux/types.h>
+#include <linux/llist.h>
+
+/*
+ * B+tree variant with several sorted keys per node (2 cache lines).
+ * Same update protocol as the binary tree: the modified path gets copied,
+ * published with rcu_assign_pointer() & the old nodes are retired via an llist.
+ * Published nodes are never modified.
+ */
+#define AVLRCU_FAT_KEYS		6
+#define AVLRCU_FAT_MAX_HEIGHT	24
+
+struct avlrcu_fat_node {
+	union {
+		struct rcu_head rcu;
+		struct llist_node old;		/* chain of old nodes to be deleted */
+	};
+	u32 count;				/* number of keys */
+	u32 leaf;
+	u64 keys[AVLRCU_FAT_KEYS];		/* sorted, unused ones are U64_MAX */
+	void __rcu *slots[AVLRCU_FAT_KEYS + 1];	/* children (count + 1) or values (count) */
+};
+
+struct avlrcu_fat_root {
+	struct avlrcu_fat_node __rcu *root;
+};
+
+extern void avlrcu_fat_init(struct avlrcu_fat_root *root);
+
+/* write-side calls, must be protected by a lock */
+extern void avlrcu_fat_free(struct avlrcu_fat_root *root);
+extern int avlrcu_fat_insert(struct avlrcu_fat_root *root, u64 key, void *value);
+extern void *avlrcu_fat_delete(struct avlrcu_fat_root *root, u64 key);
+
+/* read-side calls, must be protected by (S)RCU section */
+extern void *avlrcu_fat_search(const struct avlrcu_fat_root *root, u64 key);
+
+#endif /* _AVLRCU_FAT_H_ */
@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/sched.h>
+#include <linux/bitops.h>
+#include <linux/rcupdate.h>
+
+#include "internal.h"
+
+/*
+ * Frozen index, a read-only copy of a tree in level order (Eytzinger layout).
+ *
+ * The keys of the implicit tree are kept in an array of their own, node i has
+ * the children 2i & 2i+1, so the top levels share a few cache lines and the
+ * descendants of a node are known in advance & can be prefetched.
+ * The search has no data dependent branches.
+ *
+ * Every object is duplicated with ops->alloc() & ops->copy(), the index owns
+ * the copies & doesn't depend on the tree it was made of, at the price of a
+ * second copy of the data. The index never changes after avlrcu_freeze().
+ * Publish it with rcu_assign_pointer() & drop it with avlrcu_frozen_free().
+ *
+ * The changes made after the freeze go to a regular tree, the delta, which
+ * holds the new & replaced objects and a tombstone for every deleted one.
+ * avlrcu_frozen_lookup() checks the delta first, then the index. Fold the
+ * delta in from time to time, by freezing the merged contents again.
+ */
+struct avlrcu_frozen {
+	struct avlrcu_ops *ops;
+	unsigned long count;
+	u64 *keys;			/* level order, from 1, slot 0 is unused */
+	struct avlrcu_node **nodes;	/* copies of the objects, same order */
+};
+
+// chunk of copies between reschedules
+#define FROZEN_CHUNK	1024
+
+/* in-order walk of the implicit tree, leftmost node of the subtree at i */
+static unsigned long frozen_leftmost(unsigned long i, unsigned long count)
+{
+	while (2 * i <= count)
+		i *= 2;
+
+	return i;
+}
+
+static unsigned long frozen_next(unsigned long i, unsigned long count)
+{
+	/* leftmost node of the right subtree */
+	if (2 * i + 1 <= count)
+		return frozen_leftmost(2 * i + 1, count);
+
+	/* ascend along the right branch, 0 past the root */
+	while (i & 1)
+		i >>= 1;
+
+	return i >> 1;
+}
+
+static void frozen_free(struct avlrcu_frozen *frozen)
+{
+	struct avlrcu_ops *ops = frozen->ops;
+	unsigned long i;
+
+	if (frozen->nodes) {
+		for (i = 1; i <= frozen->count; i++) {
+			if (frozen->nodes[i])
+				ops->free(frozen->nodes[i]);
+
+			if (!(i % FROZEN_CHUNK))
+				cond_resched();
+		}
+	}
+
+	kvfree(frozen->keys);
+	kvfree(frozen->nodes);
+	kfree(frozen);
+}
+
+/**
+ * avlrcu_freeze() - copy the contents of a tree in a frozen index
+ * @root	root of the tree, must not change during the call
+ * @key		returns the key of an object, must order the objects like cmp()
+ *
+ * May sleep. Pass the root of a snapshot (see avlrcu_snapshot()),
+ * or keep the writers out with a lock that allows sleeping.
+ *
+ * Returns the index or -ENOMEM.
+ */
+struct avlrcu_frozen *avlrcu_freeze(const struct avlrcu_root *root, u64 (*key)(const struct avlrcu_node *))
+{
+	struct avlrcu_ops *ops = root->ops;
+	const struct avlrcu_node *node;
+	struct avlrcu_frozen *frozen;
+	struct avlrcu_node *copy;
+	struct avlrcu_iter iter;
+	unsigned long count = 0;
+	unsigned long i;
+
+	for (node = avlrcu_iter_first(&iter, root); node; node = avlrcu_iter_next(&iter))
+		count++;
+
+	frozen = kzalloc(sizeof(*frozen), GFP_KERNEL);
+	if (!frozen)
+		return ERR_PTR(-ENOMEM);
+
+	frozen->ops = ops;
+	frozen->count = count;
+
+	frozen->keys = kvmalloc_array(count + 1, sizeof(u64), GFP_KERNEL);
+	frozen->nodes = kvcalloc(count + 1, sizeof(struct avlrcu_node *), GFP_KERNEL);
+	if (!frozen->keys || !frozen->nodes)
+		goto error;
+
+	/* the in-order walks of the tree & of the implicit tree go together */
+	i = frozen_leftmost(1, count);
+	count = 0;
+
+	for (node = avlrcu_iter_first(&iter, root); node; node = avlrcu_iter_next(&iter)) {
+		copy = ops->alloc();
+		if (!copy)
+			goto error;
+
+		/* the copy is not linked anywhere */
+		ops->copy(copy, node);
+		copy->parent = NULL;
+		copy->left = NULL;
+		copy->right = NULL;
+
+		frozen->keys[i] = key(node);
+		frozen->nodes[i] = copy;
+		i = frozen_next(i, frozen->count);
+
+		if (!(++count % FROZEN_CHUNK))
+			cond_resched();
+	}
+
+	return frozen;
+
+error:
+	frozen_free(frozen);
+	return ERR_PTR(-ENOMEM);
+}
+
+/**
+ * avlrcu_frozen_free() - free a frozen index after a grace period
+ * @frozen	the index, already unpublished
+ *
+ * May sleep, waits for the readers that may still see the index.
+ */
+void avlrcu_frozen_free(struct avlrcu_frozen *frozen)
+{
+	synchronize_rcu();
+	frozen_free(frozen);
+}
+
+/**
+ * avlrcu_frozen_search() - search for an object in a frozen index
+ * @frozen	the index
+ * @key		key of the object
+ *
+ * Must be protected by (S)RCU section if the index is published.
+ *
+ * Returns the copy of the object or NULL.
+ */
+const struct avlrcu_node *avlrcu_frozen_search(const struct avlrcu_frozen *frozen, u64 key)
+{
+	const u64 *keys = frozen->keys;
+	unsigned long count = frozen->count;
+	unsigned long i = 1;
+
+	while (i <= count) {
+		/* the descendants 4 levels down share 2 cache lines, prefetch doesn't fault past the end */
+		prefetch(keys + 16 * i);
+		i = 2 * i + (keys[i] < key);
+	}
+
+	/* undo the right turns after the last left turn, lands on the first key >= key */
+	i >>= ffz(i) + 1;
+
+	if (i && keys[i] == key)
+		return frozen->nodes[i];
+
+	return NULL;
+}
+
+/**
+ * avlrcu_frozen_lookup() - search for an object in a frozen index & its delta
+ * @frozen	the index
+ * @delta	root of the tree with the changes made after the freeze
+ * @match	object with the key of @key
+ * @key		key of the object
+ * @dead	tells if an object of the delta is a tombstone
+ *
+ * Must be protected by (S)RCU section, the delta is a live tree.
+ * The objects of the delta shadow the ones in the index, a tombstone hides
+ * the object of the index with the same key.
+ *
+ * Returns the object, from the delta or the index, or NULL.
+ */
+const struct avlrcu_node *avlrcu_frozen_lookup(const struct avlrcu_frozen *frozen, const struct avlrcu_root *delta,
+					       const struct avlrcu_node *match, u64 key,
+					       bool (*dead)(const struct avlrcu_node *))
+{
+	const struct avlrcu_node *node;
+
+	node = avlrcu_search(delta, match);
+	if (node)
+		return dead(node) ? NULL : node;
+
+	return avlrcu_frozen_search(frozen, key);
+}
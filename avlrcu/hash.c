@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/rculist.h>
+
+#include "internal.h"
+
+/*
+ * Exact match index, an RCU hash table next to the tree.
+ *
+ * The index is a subset of the tree, it never returns content a search could
+ * not return. The tree publishes copies of the nodes with every update, the
+ * index follows:
+ * - a copy takes the place of its original as soon as it is made, in
+ *   prealloc_replace(), same content, no bucket scan; a failed update puts the
+ *   originals back & frees the copies after a grace period
+ * - a new node is added once its branch is linked, the only bucket scan
+ * - a replacement (avlrcu_replace()) takes the place of its node once linked,
+ *   until then the index returns the old node, like a search started earlier
+ * - a deleted node is removed before the new branch gets published
+ * A new node is missing from the index for a while after its branch is
+ * published: a miss is not an answer, the caller must fall back to
+ * avlrcu_search(). The bucket scans stay out of the publishing window
+ * (seqcount, preemption disabled).
+ *
+ * The table is sized once, from the number of nodes expected, & never resized.
+ * Past that number the chains grow longer, the lookups slower.
+ */
+#define HASH_MIN_BITS	4
+
+static struct hlist_head *hash_bucket(struct avlrcu_hash *hash, const struct avlrcu_node *node)
+{
+	return &hash->buckets[hash_long(hash->key(node), hash->bits)];
+}
+
+/**
+ * avlrcu_hash_init() - add an exact match index to a tree
+ * @root	root of the tree, empty & not yet in use
+ * @nodes	number of nodes expected in the tree, one bucket per node (rounded up)
+ * @key		returns the key of the object (mixed by the index)
+ *
+ * Returns 0 on success or -ENOMEM.
+ */
+int avlrcu_hash_init(struct avlrcu_root *root, unsigned long nodes, unsigned long (*key)(const struct avlrcu_node *))
+{
+	struct avlrcu_hash *hash;
+	unsigned int bits;
+
+	ASSERT(!root->root);
+
+	bits = max_t(unsigned int, order_base_2(nodes), HASH_MIN_BITS);
+
+	hash = kvzalloc(struct_size(hash, buckets, 1UL << bits), GFP_KERNEL);
+	if (!hash)
+		return -ENOMEM;
+
+	hash->key = key;
+	hash->bits = bits;
+	root->hash = hash;
+
+	return 0;
+}
+
+/* the tree must be empty & no longer in use */
+void avlrcu_hash_destroy(struct avlrcu_root *root)
+{
+	kvfree(root->hash);
+	root->hash = NULL;
+}
+
+/* a new node joins the index, after its branch is linked */
+void hash_connect(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+	struct avlrcu_hash *hash = root->hash;
+	struct hlist_head *bucket;
+	struct avlrcu_node *crnt;
+
+	if (!hash)
+		return;
+
+	bucket = hash_bucket(hash, node);
+	hlist_for_each_entry(crnt, bucket, hash) {
+		if (crnt != node && root->ops->cmp(node, crnt) == 0) {
+			hlist_replace_rcu(&crnt->hash, &node->hash);
+			return;
+		}
+	}
+
+	hlist_add_head_rcu(&node->hash, bucket);
+}
+
+/* the copy (or the replacement) of a node takes its place in the index */
+void hash_replace(struct avlrcu_root *root, struct avlrcu_node *orig, struct avlrcu_node *copy)
+{
+	if (!root->hash)
+		return;
+
+	hlist_replace_rcu(&orig->hash, &copy->hash);
+
+	/* readers only follow ->next, unhashed marks the original for hash_revert() */
+	orig->hash.pprev = NULL;
+}
+
+/* the update failed, the originals on the old chain take their places back from the copies */
+void hash_revert(struct avlrcu_ctxt *ctxt)
+{
+	struct avlrcu_root *root = ctxt->root;
+	struct avlrcu_hash *hash = root->hash;
+	struct avlrcu_node *orig, *crnt;
+
+	if (!hash)
+		return;
+
+	llist_for_each_entry(orig, ctxt->old.first, old) {
+		if (!hlist_unhashed(&orig->hash))
+			continue;
+
+		hlist_for_each_entry(crnt, hash_bucket(hash, orig), hash) {
+			if (root->ops->cmp(orig, crnt) == 0) {
+				hlist_replace_rcu(&crnt->hash, &orig->hash);
+				break;
+			}
+		}
+	}
+}
+
+/* a node of a failed update, readers of the index may have seen it */
+void hash_free(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+	if (root->hash)
+		root->ops->free_rcu(node);
+	else
+		root->ops->free(node);
+}
+
+void hash_remove(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+	if (root->hash)
+		hlist_del_rcu(&node->hash);
+}
+
+/* all the nodes are gone, readers may still walk the chains until the grace period ends */
+void hash_clear(struct avlrcu_root *root)
+{
+	struct avlrcu_hash *hash = root->hash;
+	unsigned long i;
+
+	if (!hash)
+		return;
+
+	for (i = 0; i < (1UL << hash->bits); i++)
+		WRITE_ONCE(hash->buckets[i].first, NULL);
+}
+
+/**
+ * avlrcu_hash_search() - search for an object in the exact match index
+ * @root	root of the tree
+ * @match	node to match against
+ *
+ * Same semantics as avlrcu_search(), in O(1), except a new node joins the index
+ * only after it is published: a miss must fall back to avlrcu_search().
+ * Must be protected by (S)RCU section.
+ */
+const struct avlrcu_node *avlrcu_hash_search(const struct avlrcu_root *root, const struct avlrcu_node *match)
+{
+	struct avlrcu_hash *hash = root->hash;
+	struct avlrcu_node *crnt;
+
+	hlist_for_each_entry_rcu(crnt, hash_bucket(hash, match), hash)
+		if (root->ops->cmp(match, crnt) == 0)
+			return crnt;
+
+	return NULL;
+}
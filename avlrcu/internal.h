@@ -2,7 +2,12 @@
 #ifndef _AVLRCU_INTERNAL_H_
 #define _AVLRCU_INTERNAL_H_
 
+#include <linux/prefetch.h>
+#include <linux/preempt.h>
+#include <linux/ktime.h>
+
 #include "tree.h"
+#include "trace.h"
 
 #ifdef AVLRCU_DEBUG
 #define ASSERT(_expr) BUG_ON(!(_expr))
@@ -19,8 +24,11 @@ static inline bool validate_avl_balancing(struct avlrcu_root *root)
 struct avlrcu_ctxt {
 	struct avlrcu_root *root;
 	struct llist_head old;
+	struct llist_head pool;		/* nodes reserved before the tree gets modified */
 	struct avlrcu_node *removed;
+	struct avlrcu_path *path;	/* the descent to the node being updated */
 	int diff;
+	int copies;			/* nodes allocated for the new branch */
 };
 
 // flags set on parent pointer to fast determine on which side of the parent we are
@@ -84,10 +92,115 @@ static inline bool is_new_branch(struct avlrcu_node *node)
 	return !!node->new_branch;
 }
 
+/*
+ * With AVLRCU_LAZY_PARENTS, publishing doesn't fix the parents of the untouched children,
+ * these may point to retired nodes. The writer takes the parents of the old nodes
+ * from the path of its descent, the new nodes are always linked right.
+ */
+static inline bool lazy_parents(const struct avlrcu_root *root)
+{
+	return root->flags & AVLRCU_LAZY_PARENTS;
+}
+
+static inline void path_push(struct avlrcu_path *path, struct avlrcu_node *node)
+{
+	ASSERT(path->depth < AVLRCU_MAX_HEIGHT);
+
+	path->nodes[path->depth++] = node;
+}
+
+/* the position of a node on the path, -1 if it's not there (the lookups climb, start at the bottom) */
+static inline int path_index(const struct avlrcu_path *path, const struct avlrcu_node *node)
+{
+	int i;
+
+	for (i = path->depth - 1; i >= 0; i--)
+		if (path->nodes[i] == node)
+			return i;
+
+	return -1;
+}
+
+/* the parent pointer the node at @i would have, with the side flag */
+static inline struct avlrcu_node *path_parent(const struct avlrcu_path *path, int i)
+{
+	struct avlrcu_node *parent;
+
+	if (i == 0)
+		return NULL;
+
+	parent = path->nodes[i - 1];
+	return parent->left == path->nodes[i] ? make_left(parent) : make_right(parent);
+}
+
+extern void repair_parents(struct avlrcu_root *root);
+
+#ifdef AVLRCU_PREFETCH
+/* start loading both children while the current node is being compared */
+static inline void prefetch_children(const struct avlrcu_node *node)
+{
+	prefetch(rcu_access_pointer(node->left));
+	prefetch(rcu_access_pointer(node->right));
+}
+#else /* AVLRCU_PREFETCH */
+static inline void prefetch_children(const struct avlrcu_node *node)
+{
+}
+#endif /* AVLRCU_PREFETCH */
+
+/* is the node on the top hot_levels of the tree ? climbs at most hot_levels parents */
+static inline bool is_hot(const struct avlrcu_root *root, const struct avlrcu_node *node)
+{
+	int level;
+
+	for (level = 0; level < root->ops->hot_levels; level++) {
+		node = get_parent(node);
+		if (is_root(node))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Readers caching nodes (avlrcu_search_cached()) tag them with the generation.
+ * Bumped after the new version of the tree is published, before the old nodes get retired.
+ */
+static inline void publish_gen(struct avlrcu_root *root)
+{
+	smp_store_release(&root->gen, root->gen + 1);
+}
+
+/*
+ * Readers validating their searches (avlrcu_search_seq()) retry if they overlap
+ * the publishing of the new branch. Readers spin while the count is odd, keep
+ * the section short & not preemptible.
+ */
+static inline void publish_begin(struct avlrcu_root *root)
+{
+	preempt_disable();
+	write_seqcount_begin(&root->seq);
+}
+
+static inline void publish_end(struct avlrcu_root *root)
+{
+	write_seqcount_end(&root->seq);
+	preempt_enable();
+}
+
+/* published nodes must not be modified in place while there are snapshots */
+static inline bool has_snapshots(const struct avlrcu_root *root)
+{
+	return !list_empty(&root->snapshots);
+}
+
 #define NODE_FMT "(%lx, %ld)"
 #define NODE_ARG(_node) (long)(_node), (long)(_node)->balance
 
-extern struct avlrcu_node *write_search(struct avlrcu_root *root, const struct avlrcu_node *match);
+extern struct avlrcu_node *write_search(struct avlrcu_root *root, const struct avlrcu_node *match,
+					struct avlrcu_path *path);
+extern int prealloc_reserve(struct avlrcu_ctxt *ctxt, int count);
+extern void prealloc_unreserve(struct avlrcu_ctxt *ctxt);
 extern struct avlrcu_node *prealloc_replace(struct avlrcu_ctxt *ctxt, struct avlrcu_node *target);
 extern struct avlrcu_node *prealloc_parent(struct avlrcu_ctxt *ctxt, struct avlrcu_node *child);
 extern struct avlrcu_node *prealloc_child(struct avlrcu_ctxt *ctxt, struct avlrcu_node *parent, int which);
@@ -98,14 +211,90 @@ extern struct avlrcu_node *prealloc_ror(struct avlrcu_ctxt *ctxt, struct avlrcu_
 extern struct avlrcu_node *prealloc_rrl(struct avlrcu_ctxt *ctxt, struct avlrcu_node *target);
 extern struct avlrcu_node *prealloc_rlr(struct avlrcu_ctxt *ctxt, struct avlrcu_node *target);
 
-extern void avlrcu_ctxt_init(struct avlrcu_ctxt *ctxt, struct avlrcu_root *root);
+extern void avlrcu_ctxt_init(struct avlrcu_ctxt *ctxt, struct avlrcu_root *root, struct avlrcu_path *path);
 extern struct avlrcu_node *prealloc_unwind(struct avlrcu_ctxt *ctxt, struct avlrcu_node *target);
 extern struct avlrcu_node *prealloc_top(struct avlrcu_ctxt *ctxt, struct avlrcu_node *target);
+extern struct avlrcu_node *prealloc_extend(struct avlrcu_ctxt *ctxt, struct avlrcu_node *branch);
 
 void prealloc_connect(struct avlrcu_root *root, struct avlrcu_node *branch);
 extern void prealloc_remove_old(struct avlrcu_ctxt *ctxt);
 extern void _delete_prealloc(struct avlrcu_ctxt *ctxt, struct avlrcu_node *prealloc);
 
+/* exact match index */
+#ifdef AVLRCU_HASH
+extern void hash_connect(struct avlrcu_root *root, struct avlrcu_node *node);
+extern void hash_replace(struct avlrcu_root *root, struct avlrcu_node *orig, struct avlrcu_node *copy);
+extern void hash_revert(struct avlrcu_ctxt *ctxt);
+extern void hash_free(struct avlrcu_root *root, struct avlrcu_node *node);
+extern void hash_remove(struct avlrcu_root *root, struct avlrcu_node *node);
+extern void hash_clear(struct avlrcu_root *root);
+#else /* AVLRCU_HASH */
+static inline void hash_connect(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+}
+
+static inline void hash_replace(struct avlrcu_root *root, struct avlrcu_node *orig, struct avlrcu_node *copy)
+{
+}
+
+static inline void hash_revert(struct avlrcu_ctxt *ctxt)
+{
+}
+
+static inline void hash_free(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+	root->ops->free(node);
+}
+
+static inline void hash_remove(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+}
+
+static inline void hash_clear(struct avlrcu_root *root)
+{
+}
+#endif /* AVLRCU_HASH */
+
+/* latency histograms */
+#ifdef AVLRCU_LATENCY
+extern void latency_record(const struct avlrcu_root *root, enum avlrcu_latency_op op, u64 start);
+
+static inline u64 latency_start(void)
+{
+	return ktime_get_ns();
+}
+
+/* the size of the tree changed, readers look at it while recording */
+static inline void latency_count(struct avlrcu_root *root, long diff)
+{
+	WRITE_ONCE(root->count, root->count + diff);
+}
+#else /* AVLRCU_LATENCY */
+static inline void latency_record(const struct avlrcu_root *root, enum avlrcu_latency_op op, u64 start)
+{
+}
+
+static inline u64 latency_start(void)
+{
+	return 0;
+}
+
+static inline void latency_count(struct avlrcu_root *root, long diff)
+{
+}
+#endif /* AVLRCU_LATENCY */
+
+/* snapshots */
+extern bool snapshot_defer(struct avlrcu_root *root, struct llist_node *first);
+
+/* epoch based reclamation */
+extern bool epoch_retire(struct avlrcu_root *root, struct llist_node *first);
+
+/* reclaim accounting */
+extern void reclaim_init(struct avlrcu_reclaim *reclaim);
+extern void reclaim_posted(struct avlrcu_root *root, long nodes);
+extern void reclaim_deferred(struct avlrcu_root *root, long nodes);
+
 /* post-order iterator */
 extern struct avlrcu_node *avlrcu_first_po(struct avlrcu_root *root);
 extern struct avlrcu_node *avlrcu_next_po(struct avlrcu_node *node);
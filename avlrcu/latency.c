@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+
+#include "internal.h"
+
+/*
+ * Latency histograms of the API calls, built in with AVLRCU_LATENCY.
+ *
+ * One set per CPU, shared by all the trees: log2 buckets of the duration
+ * in ns, for each call & each size class of the tree it ran on.
+ * Recording is a per-CPU increment, no locking, the readers sum up the CPUs.
+ */
+struct avlrcu_latency {
+	u64 hist[AVLRCU_LAT_OPS][AVLRCU_LAT_SIZES][AVLRCU_LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct avlrcu_latency, avlrcu_latency);
+
+/* size classes of 4 bits: < 16, < 256, < 4K, < 64K, < 1M & above */
+static int latency_size(unsigned long count)
+{
+	if (!count)
+		return 0;
+
+	return min_t(int, ilog2(count) / 4, AVLRCU_LAT_SIZES - 1);
+}
+
+void latency_record(const struct avlrcu_root *root, enum avlrcu_latency_op op, u64 start)
+{
+	u64 duration = ktime_get_ns() - start;
+	int size = latency_size(READ_ONCE(root->count));
+	int bucket = min_t(int, fls64(duration), AVLRCU_LAT_BUCKETS - 1);
+
+	this_cpu_inc(avlrcu_latency.hist[op][size][bucket]);
+}
+
+/**
+ * avlrcu_latency_read() - get a latency histogram, summed up over the CPUs
+ * @op		the API call
+ * @size	size class of the tree
+ * @hist	filled in with the counts, bucket i holds durations in [2^(i-1), 2^i) ns
+ *
+ * The counts keep moving while being read, the sums are not a snapshot.
+ */
+void avlrcu_latency_read(enum avlrcu_latency_op op, int size, u64 hist[AVLRCU_LAT_BUCKETS])
+{
+	struct avlrcu_latency *lat;
+	int cpu, i;
+
+	memset(hist, 0, AVLRCU_LAT_BUCKETS * sizeof(u64));
+
+	for_each_possible_cpu(cpu) {
+		lat = per_cpu_ptr(&avlrcu_latency, cpu);
+
+		for (i = 0; i < AVLRCU_LAT_BUCKETS; i++)
+			hist[i] += READ_ONCE(lat->hist[op][size][i]);
+	}
+}
+
+/* clears all the histograms, the calls recording at the same time may be lost or kept */
+void avlrcu_latency_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&avlrcu_latency, cpu), 0, sizeof(struct avlrcu_latency));
+}
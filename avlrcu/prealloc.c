@@ -13,16 +13,20 @@
 #include <linux/slab.h>
 #include <linux/rcupdate.h>
 #include <linux/compiler.h>
+#include <linux/ktime.h>
 
 #include "internal.h"
 
 
-void avlrcu_ctxt_init(struct avlrcu_ctxt *ctxt, struct avlrcu_root *root)
+void avlrcu_ctxt_init(struct avlrcu_ctxt *ctxt, struct avlrcu_root *root, struct avlrcu_path *path)
 {
 	ctxt->root = root;
 	init_llist_head(&ctxt->old);
+	init_llist_head(&ctxt->pool);
 	ctxt->removed = NULL;
+	ctxt->path = path;
 	ctxt->diff = 0;
+	ctxt->copies = 0;
 }
 
 
@@ -81,16 +85,18 @@ struct avlrcu_node *prealloc_first_po(struct avlrcu_node *node)
  */
 void _delete_prealloc(struct avlrcu_ctxt *ctxt, struct avlrcu_node *prealloc)
 {
-	struct avlrcu_ops *ops = ctxt->root->ops;
 	struct avlrcu_node *node, *temp;
 
 	ASSERT(prealloc);
 	ASSERT(is_new_branch(prealloc));
 	ASSERT(is_root(get_parent(prealloc)) || !is_new_branch(get_parent(prealloc)));
 
+	/* the copies leave the index before they are freed */
+	hash_revert(ctxt);
+
 	avlrcu_for_each_prealloc_po_safe(node, temp, prealloc) {
 		ASSERT(is_new_branch(node));
-		ops->free(node);
+		hash_free(ctxt->root, node);
 	}
 }
 
@@ -161,30 +167,46 @@ struct avlrcu_node *prealloc_first_rin(struct avlrcu_node *node)
  * so when an in-order tree walk returns from a connected subtree,
  * it returns into the new branch and stays there.
  * Searches will start in the old branch and will stay there.
+ *
+ * The parent fix-ups on the old children only matter for the parent-based
+ * iterators & for the write side. Readers using struct avlrcu_iter never
+ * look at the parent pointers. With AVLRCU_LAZY_PARENTS, they are skipped:
+ * publishing is only the link of the branch, the old children keep pointing
+ * to the nodes they hung from (see prealloc_up()).
  */
 void prealloc_connect(struct avlrcu_root *root, struct avlrcu_node *branch)
 {
 	struct avlrcu_node **pbranch;
 	struct avlrcu_node *node;
+	int nodes = 0;
 
-	avlrcu_for_each_prealloc_rin(node, branch) {
-		ASSERT(is_new_branch(node));
+	publish_begin(root);
 
-		if (node->right && !is_new_branch(node->right))
-			rcu_assign_pointer(node->right->parent, make_right(node));
-		if (node->left && !is_new_branch(node->left))
-			rcu_assign_pointer(node->left->parent, make_left(node));
+	if (!lazy_parents(root)) {
+		avlrcu_for_each_prealloc_rin(node, branch) {
+			ASSERT(is_new_branch(node));
+
+			if (node->right && !is_new_branch(node->right))
+				rcu_assign_pointer(node->right->parent, make_right(node));
+			if (node->left && !is_new_branch(node->left))
+				rcu_assign_pointer(node->left->parent, make_left(node));
+		}
 	}
 
 	/* clear the new branch flag post-order, otherwise it breaks iteration */
 	avlrcu_for_each_prealloc_po(node, branch) {
 		ASSERT(is_new_branch(node));
 		node->new_branch = 0;
+		nodes++;
 	}
 
 	/* finally link root */
 	pbranch = get_pnode(root, branch->parent);
 	rcu_assign_pointer(*pbranch, branch);
+	publish_end(root);
+	publish_gen(root);
+
+	trace_avlrcu_connect(root, branch, nodes);
 }
 
 /*
@@ -197,24 +219,113 @@ void prealloc_connect(struct avlrcu_root *root, struct avlrcu_node *branch)
  */
 static void prealloc_connect_root(struct avlrcu_root *root)
 {
+	publish_begin(root);
 	rcu_assign_pointer(root->root, NULL);
+	publish_end(root);
+	publish_gen(root);
 }
 
 /*
  * prealloc_remove_old() - remove (RCU) nodes replaced by the new branch
  * @ctxt:	AVL operations environment (contains ops & the old nodes chain).
  *
- * All nodes in the old chain will be passed to RCU for deletion.
+ * All nodes in the old chain will be passed to RCU for deletion,
+ * or to the current epoch if the tree uses epoch based reclamation.
  */
 void prealloc_remove_old(struct avlrcu_ctxt *ctxt)
 {
 	struct avlrcu_ops *ops = ctxt->root->ops;
 	struct llist_node *node;
 	struct avlrcu_node *old, *temp;
+	long count = 0;
 
 	node = __llist_del_all(&ctxt->old);
-	llist_for_each_entry_safe(old, temp, node, old)
+
+	/* snapshots may still see the old nodes */
+	if (snapshot_defer(ctxt->root, node))
+		return;
+
+	if (epoch_retire(ctxt->root, node))
+		return;
+
+	llist_for_each_entry_safe(old, temp, node, old) {
 		ops->free_rcu(old);
+		count++;
+	}
+
+	reclaim_posted(ctxt->root, count);
+}
+
+/*
+ * prealloc_reserve() - reserve nodes for the new branch
+ * @ctxt:	AVL operations environment
+ * @count:	number of nodes to reserve
+ *
+ * Used when the operation must not fail after it started modifying the tree.
+ * The reserved nodes are used by prealloc_replace() before calling alloc().
+ *
+ * Returns 0 on success or -ENOMEM (nothing is reserved).
+ */
+int prealloc_reserve(struct avlrcu_ctxt *ctxt, int count)
+{
+	struct avlrcu_ops *ops = ctxt->root->ops;
+	struct avlrcu_node *node;
+
+	while (count--) {
+		node = ops->alloc();
+		if (!node) {
+			prealloc_unreserve(ctxt);
+			return -ENOMEM;
+		}
+
+		__llist_add(&node->old, &ctxt->pool);
+	}
+
+	return 0;
+}
+
+/*
+ * prealloc_unreserve() - release the reserved nodes that were not used
+ * @ctxt:	AVL operations environment
+ */
+void prealloc_unreserve(struct avlrcu_ctxt *ctxt)
+{
+	struct avlrcu_ops *ops = ctxt->root->ops;
+	struct llist_node *node;
+	struct avlrcu_node *reserved, *temp;
+
+	node = __llist_del_all(&ctxt->pool);
+	llist_for_each_entry_safe(reserved, temp, node, old)
+		ops->free(reserved);
+}
+
+static struct avlrcu_node *prealloc_alloc(struct avlrcu_ctxt *ctxt, struct avlrcu_node *target)
+{
+	struct avlrcu_ops *ops = ctxt->root->ops;
+	struct llist_node *first = ctxt->pool.first;
+	struct avlrcu_node *node;
+
+	/* copies of the top levels go to the hot memory, if there is any left */
+	/* (is_hot() climbs the parents, these may be stale with AVLRCU_LAZY_PARENTS) */
+	if (ops->alloc_hot && !lazy_parents(ctxt->root) && is_hot(ctxt->root, target)) {
+		node = ops->alloc_hot();
+		if (node)
+			goto out;
+	}
+
+	if (first) {
+		ctxt->pool.first = first->next;
+		node = llist_entry(first, struct avlrcu_node, old);
+		goto out;
+	}
+
+	node = ops->alloc();
+	if (!node)
+		return NULL;
+
+out:
+	ctxt->copies++;
+	return node;
 }
 
 /*
@@ -228,25 +339,54 @@ struct avlrcu_node *prealloc_replace(struct avlrcu_ctxt *ctxt, struct avlrcu_nod
 {
 	struct avlrcu_ops *ops = ctxt->root->ops;
 	struct avlrcu_node *prealloc;
-
-	/* helps count allocations in performance measurements */
-	pr_debug("%s: node "NODE_FMT"\n", __func__, NODE_ARG(target));
+	int i;
 
 	ASSERT(!is_new_branch(target));
 
 	/* start by allocating a node that replaces target */
-	prealloc = ops->alloc();
+	prealloc = prealloc_alloc(ctxt, target);
 	if (!prealloc)
 		return NULL;
 
 	ops->copy(prealloc, target);
 	prealloc->new_branch = 1;
 
+	/* same content, the copy is what readers of the index get from now on */
+	hash_replace(ctxt->root, target, prealloc);
+
+	/* the parent of an ancestor may be stale, the copies off the path get linked by the caller */
+	if (lazy_parents(ctxt->root)) {
+		i = path_index(ctxt->path, target);
+		if (i >= 0)
+			prealloc->parent = path_parent(ctxt->path, i);
+	}
+
 	__llist_add(&target->old, &ctxt->old);		/* add to chain of old nodes */
 
 	return prealloc;
 }
 
+/*
+ * prealloc_up() - the parent pointer of a node, with the side flag
+ * @ctxt - AVL operation environment
+ * @node - a node on the new branch, or an old node on the path of the descent
+ *
+ * The new nodes are always linked right. With AVLRCU_LAZY_PARENTS, the old
+ * nodes may point to retired parents, theirs come from the path.
+ */
+static struct avlrcu_node *prealloc_up(struct avlrcu_ctxt *ctxt, struct avlrcu_node *node)
+{
+	int i;
+
+	if (!lazy_parents(ctxt->root) || is_new_branch(node))
+		return node->parent;
+
+	i = path_index(ctxt->path, node);
+	ASSERT(i >= 0);
+
+	return path_parent(ctxt->path, i);
+}
+
 /*
  * prealloc_link_left() - connect parent & child on the new branch
  * @parent - parent on the new branch
@@ -366,8 +506,7 @@ static struct avlrcu_node *prealloc_retrace_ror(struct avlrcu_node *target)
 	struct avlrcu_node *new_root = pivot;
 	struct avlrcu_node *new_pivot = target;
 
-	/* helps count rotations in performance measurements */
-	pr_debug("%s: root "NODE_FMT"\n", __func__, NODE_ARG(target));
+	trace_avlrcu_rotate(target, AVLRCU_ROT_ROR, true);
 
 	ASSERT(is_new_branch(target));
 	ASSERT(is_new_branch(pivot));
@@ -407,8 +546,7 @@ static struct avlrcu_node *prealloc_retrace_rlr(struct avlrcu_node *target)
 	struct avlrcu_node *new_left = left;		// new Z
 	struct avlrcu_node *new_right = target;		// new X
 
-	/* helps count rotations (2) in performance measurements */
-	pr_debug("%s: root "NODE_FMT"\n", __func__, NODE_ARG(target));
+	trace_avlrcu_rotate(target, AVLRCU_ROT_RLR, true);
 
 	ASSERT(is_new_branch(target));
 	ASSERT(is_new_branch(left));
@@ -457,8 +595,7 @@ static struct avlrcu_node *prealloc_retrace_rol(struct avlrcu_node *target)
 	struct avlrcu_node *new_root = pivot;
 	struct avlrcu_node *new_pivot = target;
 
-	/* helps count rotations in performance measurements */
-	pr_debug("%s: root "NODE_FMT"\n", __func__, NODE_ARG(target));
+	trace_avlrcu_rotate(target, AVLRCU_ROT_ROL, true);
 
 	ASSERT(is_new_branch(target));
 	ASSERT(is_new_branch(pivot));
@@ -475,8 +612,8 @@ static struct avlrcu_node *prealloc_retrace_rol(struct avlrcu_node *target)
 
 	// fix balance factors
 	if (pivot->balance == 0) {
-		new_root->balance = 1;
-		new_pivot->balance = -1;
+		new_root->balance = -1;
+		new_pivot->balance = 1;
 	}
 	else {
 		new_pivot->balance = 0;
@@ -498,8 +635,7 @@ static struct avlrcu_node *prealloc_retrace_rrl(struct avlrcu_node *target)
 	struct avlrcu_node *new_left = target;		// new X
 	struct avlrcu_node *new_right = right;		// new Z
 
-	/* helps count rotations (2) in performance measurements */
-	pr_debug("%s: root "NODE_FMT"\n", __func__, NODE_ARG(target));
+	trace_avlrcu_rotate(target, AVLRCU_ROT_RRL, true);
 
 	ASSERT(is_new_branch(target));
 	ASSERT(is_new_branch(right));
@@ -547,7 +683,8 @@ static struct avlrcu_node *prealloc_retrace_rrl(struct avlrcu_node *target)
  * @parent	parent that needs rotation
  *
  * A rotation (the only one) on the parent is needed for insert retrace.
- * The parent and its first pivot are both on the old branch (the tree).
+ * The parent and its first pivot are both on the old branch (the tree),
+ * or both already copied, with snapshots (see avlrcu_insert()).
  * If the rotation is a double rotation, the 2nd pivot may be the new node.
  * Neither the parent nor the pivot are balanced. Detect the case.
  * New nodes are allocated for the rotation(s) and connected with the
@@ -563,17 +700,17 @@ static struct avlrcu_node *retrace_prepare_rotation(struct avlrcu_ctxt *ctxt, st
 	struct avlrcu_node *pivot2, *new_pivot2;
 
 	ASSERT(is_new_branch(initial));
-	ASSERT(!is_new_branch(parent));
 	ASSERT(parent->balance != 0);
 
-	parent = prealloc_replace(ctxt, parent);
-	if (!parent)
-		goto error_initial;
+	if (!is_new_branch(parent)) {
+		parent = prealloc_replace(ctxt, parent);
+		if (!parent)
+			goto error_initial;
+	}
 
 	/* detect the type of rotation needed by the combination of balances */
 	if (parent->balance < 0) {
 		pivot1 = parent->left;
-		ASSERT(!is_new_branch(pivot1));
 		ASSERT(pivot1->balance != 0);
 
 		new_pivot1 = prealloc_child(ctxt, parent, LEFT_CHILD);
@@ -587,7 +724,6 @@ static struct avlrcu_node *retrace_prepare_rotation(struct avlrcu_ctxt *ctxt, st
 				prealloc_link_right(new_pivot1, initial);
 			else {
 				pivot2 = new_pivot1->right;
-				ASSERT(!is_new_branch(pivot2));
 				ASSERT(pivot2->balance != 0);
 
 				new_pivot2 = prealloc_child(ctxt, new_pivot1, RIGHT_CHILD);
@@ -612,7 +748,6 @@ static struct avlrcu_node *retrace_prepare_rotation(struct avlrcu_ctxt *ctxt, st
 	}
 	else {
 		pivot1 = parent->right;
-		ASSERT(!is_new_branch(pivot1));
 		ASSERT(pivot1->balance != 0);
 
 		new_pivot1 = prealloc_child(ctxt, parent, RIGHT_CHILD);
@@ -626,7 +761,6 @@ static struct avlrcu_node *retrace_prepare_rotation(struct avlrcu_ctxt *ctxt, st
 				prealloc_link_left(new_pivot1, initial);
 			else {
 				pivot2 = new_pivot1->left;
-				ASSERT(!is_new_branch(pivot2));
 				ASSERT(pivot2->balance != 0);
 
 				new_pivot2 = prealloc_child(ctxt, new_pivot1, LEFT_CHILD);
@@ -675,13 +809,16 @@ error_initial:
  */
 static struct avlrcu_node *insert_retrace(struct avlrcu_ctxt *ctxt, struct avlrcu_node *prealloc)
 {
-	struct avlrcu_node *node, *parent;
+	struct avlrcu_node *node, *parent, *up;
 
 	ASSERT(is_new_branch(prealloc));
 
-	/* iterate over the node-parent pair, starting at the new node */
-	for (node = prealloc, parent = get_parent(node); !is_root(parent); node = parent, parent = get_parent(node)) {
-		if (is_left_child(node->parent)) {
+	/* iterate over the node-parent pair, starting at the new node, the ancestors are old nodes */
+	for (node = prealloc, up = prealloc_up(ctxt, node), parent = strip_flags(up); !is_root(parent);
+	     node = parent, up = prealloc_up(ctxt, node), parent = strip_flags(up)) {
+		trace_avlrcu_retrace_step(parent, 1);
+
+		if (is_left_child(up)) {
 			// parent is left-heavy (this won't happen in the first iteration)
 			if (parent->balance < 0) {
 				// rotation is needed
@@ -754,58 +891,79 @@ revert:
 	return NULL;
 };
 
-/**
- * avlrcu_insert() - insert new node into the tree
+/*
+ * insert_node() - insert new node at a position found by the caller
  * @root - the root of the tree
  * @node - the new node to be added
+ * @path - the descent, ends with the node getting the new node as a child
+ * @link - the link the new node goes to
+ * @lat_start - latency_start() before the caller's descent
  *
- * The object containing the node must be allocated & compatible with the deletion callback.
- * The object starts a new branch that gets connected to the tree after retrace.
- * WARNING: The node must be zeroed before insertion.
- *
- * Returns 0 on success or an error code.
+ * The core of all inserts, records the latency for every outcome.
  */
-int avlrcu_insert(struct avlrcu_root *root, struct avlrcu_node *node)
+static int insert_node(struct avlrcu_root *root, struct avlrcu_node *node,
+		       struct avlrcu_path *path, struct avlrcu_node **link, u64 lat_start)
 {
-	struct avlrcu_ops *ops = root->ops;
-	struct avlrcu_node *crnt, *parent;
+	struct avlrcu_node *parent = path->depth ? path->nodes[path->depth - 1] : NULL;
 	struct avlrcu_node *prealloc;
 	struct avlrcu_ctxt ctxt;
+	bool trace = trace_avlrcu_insert_enabled();	/* the same for the start & the end */
+	int depth = path->depth;		/* the ancestors of the new node */
+	u64 start = 0;
 	int result;
 
 	ASSERT(node->balance == 0);
 	ASSERT(is_leaf(node));
+	ASSERT(*link == NULL);
 
 	if (!validate_avl_balancing(root)) {
 		pr_err("%s: the tree is not in AVL shape\n", __func__);
-		return -EINVAL;
+		result = -EINVAL;
+		goto out;
 	}
 
-	/* look for a parent */
-	for (crnt = root->root, parent = NULL; crnt != NULL; ) {
-		result = ops->cmp(node, crnt);
-
-		if (unlikely(result == 0))
-			return -EEXIST;
-		else if (result < 0) {
-			parent = make_left(crnt);
-			crnt = crnt->left;
-		}
-		else {
-			parent = make_right(crnt);
-			crnt = crnt->right;
-		}
-	}
+	if (parent)
+		parent = link == &parent->left ? make_left(parent) : make_right(parent);
 
 	node->parent = parent;		/* only link one way */
 	node->new_branch = 1;
 
-	avlrcu_ctxt_init(&ctxt, root);
+	avlrcu_ctxt_init(&ctxt, root, path);
+
+	if (trace)
+		start = ktime_get_ns();
+
+	/*
+	 * retrace modifies balance factors in place, the snapshots must not see that:
+	 * all the ancestors of the new node get copied before retrace, which then
+	 * works on the copies only, rotations included
+	 */
+	if (has_snapshots(root)) {
+		result = prealloc_reserve(&ctxt, depth);
+		if (result)
+			goto out;
+
+		/* path copying, can't fail on the reserved nodes */
+		prealloc = prealloc_extend(&ctxt, node);
+		ASSERT(prealloc);
+
+		prealloc = insert_retrace(&ctxt, node);
+		ASSERT(prealloc);
+
+		/* a rotated subtree takes the place of its old root on the path */
+		if (!is_root(prealloc->parent))
+			*get_pnode(root, prealloc->parent) = prealloc;
+
+		prealloc_connect(root, prealloc_top(&ctxt, prealloc));
+		goto remove_old;
+	}
 
 	/* retrace generates the preallocated branch */
 	prealloc = insert_retrace(&ctxt, node);
-	if (!prealloc)
-		return -ENOMEM;
+	if (!prealloc) {
+		result = -ENOMEM;
+		goto out;
+	}
 
 	/*
 	 * the new node & the preallocated branch are already connected
@@ -825,10 +983,341 @@ int avlrcu_insert(struct avlrcu_root *root, struct avlrcu_node *node)
 	if (prealloc != node)
 		prealloc_connect(root, prealloc);
 
+remove_old:
+	/* linked, the new node joins the index */
+	hash_connect(root, node);
+
+	prealloc_unreserve(&ctxt);
+
 	/* nodes are replaced only in the retrace step */
 	if (!llist_empty(&ctxt.old))
 		prealloc_remove_old(&ctxt);
 
+	validate_avl_balancing(root);
+	latency_count(root, 1);
+
+	if (trace)
+		trace_avlrcu_insert(root, node, depth, ctxt.copies, ktime_get_ns() - start);
+
+	result = 0;
+out:
+	latency_record(root, AVLRCU_LAT_INSERT, lat_start);
+
+	return result;
+}
+
+/*
+ * insert_descent() - write-side descent to the place of a new node
+ * @root - the root of the tree
+ * @node - the new node
+ * @path - filled in with the nodes visited (the parent of the new node last)
+ * @plink - the link the new node goes to
+ *
+ * Returns the node with the same key (last on the path), or NULL & the place of the new node.
+ */
+static struct avlrcu_node *insert_descent(struct avlrcu_root *root, const struct avlrcu_node *node,
+					  struct avlrcu_path *path, struct avlrcu_node ***plink)
+{
+	struct avlrcu_ops *ops = root->ops;
+	struct avlrcu_node **link = &root->root;
+	struct avlrcu_node *parent;
+	int result;
+
+	/* look for a parent */
+	path->depth = 0;
+	while (*link) {
+		parent = *link;
+		path_push(path, parent);
+		result = ops->cmp(node, parent);
+
+		if (unlikely(result == 0))
+			return parent;
+		else if (result < 0)
+			link = &parent->left;
+		else
+			link = &parent->right;
+	}
+
+	*plink = link;
+
+	return NULL;
+}
+
+/**
+ * avlrcu_insert_at() - insert new node at a position found by the caller
+ * @root - the root of the tree
+ * @node - the new node to be added
+ * @path - the nodes visited by the descent, from the root down to the parent of the new node
+ * @link - &parent->left or &parent->right, &root->root if the tree is empty
+ *
+ * For callers doing their own descent (see DEFINE_AVLRCU_TREE()), under the
+ * same lock as the update. Same rules as avlrcu_insert().
+ *
+ * Returns 0 on success or an error code.
+ */
+int avlrcu_insert_at(struct avlrcu_root *root, struct avlrcu_node *node,
+		     struct avlrcu_path *path, struct avlrcu_node **link)
+{
+	return insert_node(root, node, path, link, latency_start());
+}
+
+/**
+ * avlrcu_insert() - insert new node into the tree
+ * @root - the root of the tree
+ * @node - the new node to be added
+ *
+ * The object containing the node must be allocated & compatible with the deletion callback.
+ * The object starts a new branch that gets connected to the tree after retrace.
+ * WARNING: The node must be zeroed before insertion.
+ *
+ * Returns 0 on success or an error code.
+ */
+int avlrcu_insert(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+	struct avlrcu_path path;
+	struct avlrcu_node **link;
+	u64 start = latency_start();
+
+	if (insert_descent(root, node, &path, &link)) {
+		latency_record(root, AVLRCU_LAT_INSERT, start);
+		return -EEXIST;
+	}
+
+	return insert_node(root, node, &path, link, start);
+}
+
+/**
+ * avlrcu_insert_or_get() - insert new node into the tree, or get the node with the same key
+ * @root - the root of the tree
+ * @node - the new node to be added
+ * @existing - the node with the same key, NULL if the new node was inserted
+ *
+ * Same as avlrcu_insert(), with a single descent for both outcomes.
+ * The existing node belongs to the tree, it's valid until the lock is dropped.
+ *
+ * Returns 0 on success, -EEXIST if the key is in the tree or another error code.
+ */
+int avlrcu_insert_or_get(struct avlrcu_root *root, struct avlrcu_node *node, struct avlrcu_node **existing)
+{
+	struct avlrcu_path path;
+	struct avlrcu_node **link;
+	u64 start = latency_start();
+
+	*existing = insert_descent(root, node, &path, &link);
+	if (*existing) {
+		latency_record(root, AVLRCU_LAT_INSERT, start);
+		return -EEXIST;
+	}
+
+	return insert_node(root, node, &path, link, start);
+}
+
+/*
+ * replace_node() - replace a node with a new one, with the same key
+ * @root - the root of the tree
+ * @target - the node in the tree
+ * @node - the replacement
+ * @path - the descent, ends with the target
+ * @lat_start - latency_start() before the caller's descent
+ *
+ * Counts as an insert in the latency histograms.
+ */
+static int replace_node(struct avlrcu_root *root, struct avlrcu_node *target, struct avlrcu_node *node,
+			struct avlrcu_path *path, u64 lat_start)
+{
+	struct avlrcu_node *prealloc;
+	struct avlrcu_ctxt ctxt;
+	int result;
+
+	ASSERT(node->balance == 0);
+	ASSERT(is_leaf(node));
+
+	if (!validate_avl_balancing(root)) {
+		pr_err("%s: the tree is not in AVL shape\n", __func__);
+		result = -EINVAL;
+		goto out;
+	}
+
+	avlrcu_ctxt_init(&ctxt, root, path);
+
+	/* the copies of the ancestors are reserved, path copying can't fail */
+	if (has_snapshots(root)) {
+		result = prealloc_reserve(&ctxt, path->depth - 1);
+		if (result)
+			goto out;
+	}
+
+	/* the replacement is a single node branch, same links as the target */
+	node->parent = prealloc_up(&ctxt, target);
+	node->left = target->left;
+	node->right = target->right;
+	node->balance = target->balance;
+	node->new_branch = 1;
+
+	__llist_add(&target->old, &ctxt.old);
+
+	prealloc = node;
+	if (has_snapshots(root)) {
+		prealloc = prealloc_extend(&ctxt, prealloc);
+		ASSERT(prealloc);
+	}
+
+	prealloc_connect(root, prealloc);
+	hash_replace(root, target, node);
+	prealloc_unreserve(&ctxt);
+	prealloc_remove_old(&ctxt);
+
+	validate_avl_balancing(root);
+
+	result = 0;
+out:
+	latency_record(root, AVLRCU_LAT_INSERT, lat_start);
+
+	return result;
+}
+
+/**
+ * avlrcu_replace() - replace a node with a new one, with the same key
+ * @root - the root of the tree
+ * @match - node to match against
+ * @node - the replacement, zeroed, compares equal to the match
+ *
+ * The replacement takes the links of the old node & gets published in its place,
+ * the shape of the tree doesn't change. Only the old node is retired (RCU),
+ * readers may still find it until the grace period ends.
+ * With snapshots, the ancestors get copied too.
+ *
+ * Returns 0 on success or an error code:
+ *	-ENXIO - no node matches
+ *	-EINVAL - the replacement has another key
+ *	-ENOMEM - allocations failed (only with snapshots)
+ *
+ * On error, the tree is not modified.
+ */
+int avlrcu_replace(struct avlrcu_root *root, const struct avlrcu_node *match, struct avlrcu_node *node)
+{
+	struct avlrcu_node *target;
+	struct avlrcu_path path;
+	u64 start = latency_start();
+
+	target = write_search(root, match, &path);
+	if (!target) {
+		latency_record(root, AVLRCU_LAT_INSERT, start);
+		return -ENXIO;
+	}
+
+	if (root->ops->cmp(node, target) != 0) {
+		latency_record(root, AVLRCU_LAT_INSERT, start);
+		return -EINVAL;
+	}
+
+	return replace_node(root, target, node, &path, start);
+}
+
+/**
+ * avlrcu_upsert() - insert new node into the tree, or replace the node with the same key
+ * @root - the root of the tree
+ * @node - the new node, zeroed
+ *
+ * A single descent, then either avlrcu_insert() or avlrcu_replace().
+ * The replaced node is retired like the nodes copied by the updates.
+ *
+ * Returns 0 if the node was inserted, 1 if it replaced another node, or an error code.
+ * On error, the tree is not modified.
+ */
+int avlrcu_upsert(struct avlrcu_root *root, struct avlrcu_node *node)
+{
+	struct avlrcu_node *target, **link;
+	struct avlrcu_path path;
+	u64 start = latency_start();
+	int result;
+
+	target = insert_descent(root, node, &path, &link);
+	if (!target)
+		return insert_node(root, node, &path, link, start);
+
+	result = replace_node(root, target, node, &path, start);
+	if (result)
+		return result;
+
+	return 1;
+}
+
+/* copy the children of a node on the new branch, for the given number of levels */
+static int repack_children(struct avlrcu_ctxt *ctxt, struct avlrcu_node *parent, int levels)
+{
+	struct avlrcu_node *child;
+	int result;
+
+	if (levels == 0)
+		return 0;
+
+	if (parent->left) {
+		child = prealloc_child(ctxt, parent, LEFT_CHILD);
+		if (!child)
+			return -ENOMEM;
+
+		result = repack_children(ctxt, child, levels - 1);
+		if (result)
+			return result;
+	}
+
+	if (parent->right) {
+		child = prealloc_child(ctxt, parent, RIGHT_CHILD);
+		if (!child)
+			return -ENOMEM;
+
+		result = repack_children(ctxt, child, levels - 1);
+		if (result)
+			return result;
+	}
+
+	return 0;
+}
+
+/**
+ * avlrcu_repack() - copy the top levels of the tree to the hot memory
+ * @root:	the tree
+ *
+ * Updates copy the nodes on the top levels with alloc_hot(), but the nodes
+ * rotated up from the lower levels or copied while the hot memory was exhausted
+ * stay where they were allocated. Call after bulk updates to pack the top levels again.
+ * The recursion is bounded by hot_levels.
+ *
+ * Returns 0 on success, -EINVAL if the tree has no hot memory (none is used
+ * with AVLRCU_LAZY_PARENTS) or -ENOMEM (the tree is unchanged).
+ */
+int avlrcu_repack(struct avlrcu_root *root)
+{
+	struct avlrcu_ops *ops = root->ops;
+	struct avlrcu_node *prealloc;
+	struct avlrcu_ctxt ctxt;
+	struct avlrcu_path path;
+	int result;
+
+	if (!ops->alloc_hot || ops->hot_levels <= 0 || lazy_parents(root))
+		return -EINVAL;
+
+	if (!root->root)
+		return 0;
+
+	path.depth = 0;
+	path_push(&path, root->root);
+	avlrcu_ctxt_init(&ctxt, root, &path);
+
+	prealloc = prealloc_replace(&ctxt, root->root);
+	if (!prealloc)
+		return -ENOMEM;
+
+	result = repack_children(&ctxt, prealloc, ops->hot_levels - 1);
+	if (result) {
+		_delete_prealloc(&ctxt, prealloc);
+		return result;
+	}
+
+	prealloc_connect(root, prealloc);
+	prealloc_remove_old(&ctxt);
+
 	validate_avl_balancing(root);
 
 	return 0;
@@ -981,8 +1470,7 @@ struct avlrcu_node *prealloc_rol(struct avlrcu_ctxt *ctxt, struct avlrcu_node *t
 	struct balance_factors new_balance;
 	int diff_height;
 
-	/* helps count rotations in performance measurements */
-	pr_debug("%s: root "NODE_FMT"\n", __func__, NODE_ARG(target));
+	trace_avlrcu_rotate(target, AVLRCU_ROT_ROL, false);
 
 	ASSERT(is_new_branch(target));
 	ASSERT(is_new_branch(pivot));
@@ -1034,8 +1522,7 @@ struct avlrcu_node *prealloc_ror(struct avlrcu_ctxt *ctxt, struct avlrcu_node *t
 	struct balance_factors new_balance;
 	int diff_height;
 
-	/* helps count rotations in performance measurements */
-	pr_debug("%s: root "NODE_FMT"\n", __func__, NODE_ARG(target));
+	trace_avlrcu_rotate(target, AVLRCU_ROT_ROR, false);
 
 	ASSERT(is_new_branch(target));
 	ASSERT(is_new_branch(pivot));
@@ -1390,6 +1877,38 @@ struct avlrcu_node *prealloc_top(struct avlrcu_ctxt *ctxt, struct avlrcu_node *t
 	return target;
 }
 
+/*
+ * prealloc_extend() - extend the new branch up to the root
+ * @ctxt - AVL operations environment
+ * @branch - top of the new branch
+ *
+ * Snapshots share the published nodes, so none of them may be modified in place.
+ * With all the ancestors brought to the new branch (path copying),
+ * connecting the branch only publishes a new root pointer.
+ *
+ * Returns the new top of the branch or NULL on error (the branch is deleted).
+ */
+struct avlrcu_node *prealloc_extend(struct avlrcu_ctxt *ctxt, struct avlrcu_node *branch)
+{
+	struct avlrcu_node *parent;
+
+	ASSERT(is_new_branch(branch));
+
+	while (!is_root(branch->parent)) {
+		parent = prealloc_parent(ctxt, branch);
+		if (!parent)
+			goto error;
+
+		branch = parent;
+	}
+
+	return branch;
+
+error:
+	_delete_prealloc(ctxt, branch);
+	return NULL;
+}
+
 /* prealloc_unwind() - bubble a node down to a leaf
  * @ctxt - AVL operations environment
  * @target - node to be bublled
@@ -1532,6 +2051,8 @@ static struct avlrcu_node *delete_retrace(struct avlrcu_ctxt *ctxt, struct avlrc
 		if (!parent)
 			goto error;
 
+		trace_avlrcu_retrace_step(parent, -1);
+
 		if (is_left_child(node->parent)) {
 			if (parent->balance > 0) {
 				sibling = prealloc_child(ctxt, parent, RIGHT_CHILD);
@@ -1604,6 +2125,69 @@ error:
 	return NULL;
 }
 
+/*
+ * unlink_retrace() - unlink a node with at most one child
+ * @ctxt - AVL operations environment
+ * @node - target node to delete
+ *
+ * The child (a leaf, if any) takes the place of the node, the subtree represented
+ * by that node decreases in height, so retrace creates a new branch starting
+ * with its parent. The node itself is not copied.
+ *
+ * WARNING: can return NULL as a valid value (the tree becomes empty)
+ */
+static struct avlrcu_node *unlink_retrace(struct avlrcu_ctxt *ctxt, struct avlrcu_node *node)
+{
+	struct avlrcu_node *child = node->left ? node->left : node->right;
+	struct avlrcu_node fake_leaf;
+	struct avlrcu_node *prealloc, *leaf;
+	struct avlrcu_node *parent;
+
+	ASSERT(!node->left || !node->right);
+
+	/* last such node, will have to be removed by the user */
+	ctxt->removed = node;
+
+	if (is_root(prealloc_up(ctxt, node))) {
+		/* if that node is the only node in the tree, the new branch is empty (NULL) */
+		if (!child)
+			return NULL;
+
+		/* otherwise the child becomes the root */
+		prealloc = prealloc_replace(ctxt, child);
+		if (!prealloc)
+			return ERR_PTR(-ENOMEM);
+
+		prealloc->parent = NULL;
+
+		return prealloc;
+	}
+
+	/* this fake leaf helps kick-start the new branch for retrace */
+	memcpy(&fake_leaf, node, sizeof(struct avlrcu_node));
+	fake_leaf.parent = prealloc_up(ctxt, node);
+	fake_leaf.new_branch = 1;
+	leaf = &fake_leaf;
+
+	/* retrace does not work on modified ancestor balance factors */
+	ctxt->diff = -1;
+	prealloc = delete_retrace(ctxt, leaf);
+	if (!prealloc)
+		return ERR_PTR(-ENOMEM);
+
+	/* this parent has been brought to the new branch */
+	parent = get_parent(leaf);
+	ASSERT(is_new_branch(parent));
+
+	/* the child (if any) takes the place of the node */
+	if (is_left_child(leaf->parent))
+		parent->left = child;
+	else
+		parent->right = child;
+
+	return prealloc;
+}
+
 /* unwind_delete_retrace() - unwind, delete, fix, retrace logic
  * @ctxt - AVL operations environment
  * @node - target node to delete
@@ -1620,7 +2204,8 @@ error:
  * and may add to the new branch (at the same time it will add to the old nodes chain).
  *
  * In the corner case of a leaf node being deleted, it is considered that the subtree represented
- * by that node decreseas in height, so retrace creates a new branch starting with its parent.
+ * by that node decreseas in height, so retrace creates a new branch starting with its parent
+ * (see unlink_retrace()).
  *
  * WARNING: can return NULL as a valid value (check corner case)
  */
@@ -1629,126 +2214,438 @@ static struct avlrcu_node *unwind_delete_retrace(struct avlrcu_ctxt *ctxt, struc
 	struct avlrcu_node *prealloc, *leaf;
 	struct avlrcu_node *parent;
 
-	if (is_leaf(node)) {
-		struct avlrcu_node fake_leaf;
+	if (is_leaf(node))
+		return unlink_retrace(ctxt, node);
 
-		/* last such node, will have to be removed by the user */
-		ctxt->removed = node;
+	/* bubble target node to the bottom */
+	leaf = prealloc_unwind(ctxt, node);
+	if (!leaf)
+		return ERR_PTR(-ENOMEM);
 
-		/* if that node is the only node in the tree, the new branch is empty (NULL) */
-		if (is_root(node->parent))
+	/*
+	 * nodes along this branch may be heavy towards the leaf or balanced
+	 * this also applies to its direct parent, if it's leaf-heavy,
+	 * deleting the leaf will propagate the change up the new branch
+	 */
+	prealloc_propagate_change(ctxt, leaf, -1);
+
+	/* parent is directly available */
+	parent = get_parent(leaf);
+
+	/* clear pointer in parent pointing to the leaf */
+	if (is_left_child(leaf->parent))
+		parent->left = NULL;
+	else
+		parent->right = NULL;
+
+	/* last such node, will have to be removed by the user */
+	ctxt->removed = leaf;
+	/* (this is an exact copy of the original target) */
+
+	/* fix excessive unbalances introduced by unwind */
+	prealloc = prealloc_fix(ctxt, parent);
+
+	/* no need to retrace if there is no change in height */
+	if (ctxt->diff == 0)
+		return prealloc;
+
+	/* new branch lost height, retrace needed */
+	prealloc = delete_retrace(ctxt, prealloc);
+	if (!prealloc)
+		return ERR_PTR(-ENOMEM);
+
+	return prealloc;
+}
+
+/*
+ * swap_rebalance() - rotate a node of the new branch that got to +-2 on delete
+ * @ctxt - AVL operations environment
+ * @node - the node, on the new branch
+ * @shorter - set if the subtree lost height
+ *
+ * Same rotations as delete_retrace(), inside the new branch: the parent
+ * (if it's on the new branch too) gets linked to the new root of the subtree.
+ *
+ * Returns the new root of the subtree or NULL on error.
+ */
+static struct avlrcu_node *swap_rebalance(struct avlrcu_ctxt *ctxt, struct avlrcu_node *node, bool *shorter)
+{
+	struct avlrcu_node *parent = get_parent(node);
+	bool left_child = is_left_child(node->parent);
+	struct avlrcu_node *sibling;
+	int sibling_balance_before;
+
+	if (node->balance > 0) {
+		sibling = prealloc_child(ctxt, node, RIGHT_CHILD);
+		if (!sibling)
 			return NULL;
 
-		/* this fake leaf helps kick-start the new branch for retrace */
-		memcpy(&fake_leaf, node, sizeof(struct avlrcu_node));
-		fake_leaf.new_branch = 1;
-		leaf = &fake_leaf;
+		sibling_balance_before = sibling->balance;
 
-		/* retrace does not work on modified ancestor balance factors */
-		ctxt->diff = -1;
-		prealloc = delete_retrace(ctxt, leaf);
-		if (!prealloc)
-			return ERR_PTR(-ENOMEM);
+		if (sibling->balance < 0) {
+			if (!prealloc_child(ctxt, sibling, LEFT_CHILD))
+				return NULL;
+
+			node = prealloc_retrace_rrl(node);
+		}
+		else
+			node = prealloc_retrace_rol(node);
+	}
+	else {
+		sibling = prealloc_child(ctxt, node, LEFT_CHILD);
+		if (!sibling)
+			return NULL;
 
-		/* this parent has been brought to the new branch */
-		parent = get_parent(leaf);
-		ASSERT(is_new_branch(parent));
+		sibling_balance_before = sibling->balance;
 
-		/* clear pointer in parent pointing to the leaf */
-		if (is_left_child(leaf->parent))
-			parent->left = NULL;
+		if (sibling->balance > 0) {
+			if (!prealloc_child(ctxt, sibling, RIGHT_CHILD))
+				return NULL;
+
+			node = prealloc_retrace_rlr(node);
+		}
 		else
-			parent->right = NULL;
+			node = prealloc_retrace_ror(node);
+	}
+
+	if (!is_root(parent) && is_new_branch(parent)) {
+		if (left_child)
+			parent->left = node;
+		else
+			parent->right = node;
+	}
+
+	/* a balanced sibling keeps the height of the subtree */
+	*shorter = sibling_balance_before != 0;
+
+	return node;
+}
+
+/*
+ * swap_delete_retrace() - delete by swapping with the in-order neighbour
+ * @ctxt - AVL operations environment
+ * @target - target node to delete
+ *
+ * A target with at most one child is unlinked directly. Otherwise the neighbour
+ * on the heavier side (successor or predecessor, it has at most one child)
+ * gets copied into the position of the target, and gets unlinked instead.
+ * Only the path from the target down to the parent of the neighbour is copied,
+ * the balance is restored bottom-up on it, then by retrace above the target.
+ * Unlike unwind, there are no reverse rotations, so nothing to fix.
+ *
+ * The target itself is never copied, it is the node returned to the user.
+ *
+ * WARNING: can return NULL as a valid value (the tree becomes empty)
+ */
+static struct avlrcu_node *swap_delete_retrace(struct avlrcu_ctxt *ctxt, struct avlrcu_node *target)
+{
+	struct avlrcu_ops *ops = ctxt->root->ops;
+	struct avlrcu_node *swap, *top, *node, *temp;
+	int first, next, which;
+	bool shorter;
+
+	if (!target->left || !target->right)
+		return unlink_retrace(ctxt, target);
+
+	/* the heavier side can afford losing height */
+	if (target->balance > 0) {
+		first = RIGHT_CHILD;
+		next = LEFT_CHILD;
+		for (swap = target->right; swap->left; swap = swap->left)
+			;
 	}
 	else {
-		/* bubble target node to the bottom */
-		leaf = prealloc_unwind(ctxt, node);
-		if (!leaf)
-			return ERR_PTR(-ENOMEM);
+		first = LEFT_CHILD;
+		next = RIGHT_CHILD;
+		for (swap = target->left; swap->right; swap = swap->right)
+			;
+	}
+
+	/* the copy of the neighbour takes the position of the target */
+	top = prealloc_alloc(ctxt, target);
+	if (!top)
+		return ERR_PTR(-ENOMEM);
+
+	ops->copy(top, swap);
+	top->parent = prealloc_up(ctxt, target);
+	top->left = target->left;
+	top->right = target->right;
+	top->balance = target->balance;
+	top->new_branch = 1;
+
+	/* copy the path down to the parent of the neighbour */
+	node = top;
+	for (which = first; (which == LEFT_CHILD ? node->left : node->right) != swap; which = next) {
+		temp = prealloc_child(ctxt, node, which);
+		if (!temp)
+			goto error;
+
+		node = temp;
+	}
+
+	/* the only child of the neighbour (if any) takes its place */
+	if (which == LEFT_CHILD)
+		node->left = swap->left ? swap->left : swap->right;
+	else
+		node->right = swap->left ? swap->left : swap->right;
 
-		/*
-		 * nodes along this branch may be heavy towards the leaf or balanced
-		 * this also applies to its direct parent, if it's leaf-heavy,
-		 * deleting the leaf will propagate the change up the new branch
-		 */
-		prealloc_propagate_change(ctxt, leaf, -1);
+	/* its content lives on in the copy */
+	__llist_add(&swap->old, &ctxt->old);
+	hash_replace(ctxt->root, swap, top);
 
-		/* parent is directly available */
-		parent = get_parent(leaf);
+	/* last such node, will have to be removed by the user */
+	ctxt->removed = target;
+
+	/* the subtree of node lost height on the side of which, retrace up to top */
+	for (;;) {
+		trace_avlrcu_retrace_step(node, -1);
 
-		/* clear pointer in parent pointing to the leaf */
-		if (is_left_child(leaf->parent))
-			parent->left = NULL;
+		if (which == LEFT_CHILD)
+			node->balance += 1;
 		else
-			parent->right = NULL;
+			node->balance -= 1;
 
-		/* last such node, will have to be removed by the user */
-		ctxt->removed = leaf;
-		/* (this is an exact copy of the original target) */
+		/* was balanced, the height did not change */
+		if (node->balance == 1 || node->balance == -1)
+			return top;
 
-		/* fix excessive unbalances introduced by unwind */
-		prealloc = prealloc_fix(ctxt, parent);
+		if (node->balance != 0) {
+			temp = swap_rebalance(ctxt, node, &shorter);
+			if (!temp)
+				goto error;
 
-		/* no need to retrace if there is no change in height */
-		if (ctxt->diff == 0)
-			return prealloc;
+			if (node == top)
+				top = temp;
+			node = temp;
 
-		/* new branch lost height, retrace needed */
-		prealloc = delete_retrace(ctxt, prealloc);
-		if (!prealloc)
-			return ERR_PTR(-ENOMEM);
+			if (!shorter)
+				return top;
+		}
+
+		if (node == top)
+			break;
+
+		which = is_left_child(node->parent) ? LEFT_CHILD : RIGHT_CHILD;
+		node = get_parent(node);
 	}
 
-	return prealloc;
+	/* the whole branch lost height, retrace above the target */
+	ctxt->diff = -1;
+	top = delete_retrace(ctxt, top);
+	if (!top)
+		return ERR_PTR(-ENOMEM);
+
+	return top;
+
+error:
+	_delete_prealloc(ctxt, top);
+
+	return ERR_PTR(-ENOMEM);
 }
 
-/**
- * avlrcu_delete() - delete a node from the tree
+static inline bool delete_swap(const struct avlrcu_root *root)
+{
+	return root->flags & AVLRCU_DELETE_SWAP;
+}
+
+/*
+ * delete_target() - delete a node known to be in the current version of the tree
  * @root - root of the tree
- * @match - node to match against
- *
- * Looks in the tree for the node corresponding to the match node and extracts it.
- * The node may still be used by readers, so it's the duty of the user to free it
- * after waiting for a grace period to elapse.
+ * @target - the node
+ * @path - the descent, ends with the target
  *
- * Returns:	the extracted node on success
- *		-ENXIO - node was not found
- *		-ENOMEM - allocations failed
+ * Two strategies, selected by AVLRCU_DELETE_SWAP:
+ * - unwind (default): bubble the target down to a leaf with reverse rotations, then fix
+ * - swap: unlink the in-order neighbour of the target instead & copy it in its place,
+ *   fewer copies for targets high in the tree
+ * Both return a node that is off the tree & has the content of the target.
+ * The core of all deletes, records the latency (from @lat_start) for every outcome.
  *
- * On error, the tree is not modified.
+ * Same return values as avlrcu_delete().
  */
-struct avlrcu_node *avlrcu_delete(struct avlrcu_root *root, const struct avlrcu_node *match)
+static struct avlrcu_node *delete_target(struct avlrcu_root *root, struct avlrcu_node *target,
+					 struct avlrcu_path *path, u64 lat_start)
 {
-	struct avlrcu_node *target;
+	struct avlrcu_ops *ops = root->ops;
 	struct avlrcu_node *prealloc;
+	struct avlrcu_node *copy = NULL;
 	struct avlrcu_ctxt ctxt;
+	bool trace = trace_avlrcu_delete_enabled();	/* the same for the start & the end */
+	int depth = path->depth - 1;		/* the ancestors of the target */
+	u64 start = 0;
 
 	if (!validate_avl_balancing(root)) {
 		pr_err("%s: the tree is not in AVL shape\n", __func__);
-		return ERR_PTR(-EINVAL);
+		prealloc = ERR_PTR(-EINVAL);
+		goto error;
 	}
 
-	target = write_search(root, match);
-	if (!target)
-		return ERR_PTR(-ENXIO);
+	avlrcu_ctxt_init(&ctxt, root, path);
 
-	avlrcu_ctxt_init(&ctxt, root);
+	if (trace)
+		start = ktime_get_ns();
+
+	/* a leaf (any target, on swap) gets unlinked as it is, snapshots still see it, the user gets a copy */
+	if (has_snapshots(root) && (is_leaf(target) || delete_swap(root))) {
+		copy = ops->alloc();
+		if (!copy) {
+			prealloc = ERR_PTR(-ENOMEM);
+			goto error;
+		}
+	}
 
 	/* may return NULL as a valid value !!! */
-	prealloc = unwind_delete_retrace(&ctxt, target);
+	if (delete_swap(root))
+		prealloc = swap_delete_retrace(&ctxt, target);
+	else
+		prealloc = unwind_delete_retrace(&ctxt, target);
 	if (IS_ERR(prealloc))
-		return prealloc;
+		goto error;
+
+	if (prealloc && has_snapshots(root)) {
+		prealloc = prealloc_extend(&ctxt, prealloc);
+		if (!prealloc) {
+			/* the bubbled copy of the target is already off the branch */
+			if (ctxt.removed != target)
+				hash_free(root, ctxt.removed);
+
+			prealloc = ERR_PTR(-ENOMEM);
+			goto error;
+		}
+	}
+
+	/* the target (or its bubbled copy) leaves the index before the tree */
+	hash_remove(root, ctxt.removed);
 
 	if (prealloc)
 		prealloc_connect(root, prealloc);
 	else
 		prealloc_connect_root(root);
 
+	if (copy) {
+		ops->copy(copy, ctxt.removed);
+		__llist_add(&ctxt.removed->old, &ctxt.old);
+		ctxt.removed = copy;
+	}
+
 	// this will remove the replaced nodes
 	if (!llist_empty(&ctxt.old))
 		prealloc_remove_old(&ctxt);
 
 	validate_avl_balancing(root);
+	latency_count(root, -1);
+
+	if (trace)
+		trace_avlrcu_delete(root, target, depth, ctxt.copies, ktime_get_ns() - start);
+
+	latency_record(root, AVLRCU_LAT_DELETE, lat_start);
 
 	return ctxt.removed;
+
+error:
+	if (copy)
+		ops->free(copy);
+
+	latency_record(root, AVLRCU_LAT_DELETE, lat_start);
+
+	return prealloc;
+}
+
+/**
+ * avlrcu_delete() - delete a node from the tree
+ * @root - root of the tree
+ * @match - node to match against
+ *
+ * Looks in the tree for the node corresponding to the match node and extracts it.
+ * The node may still be used by readers, so it's the duty of the user to free it
+ * after waiting for a grace period to elapse.
+ *
+ * Returns:	the extracted node on success
+ *		-ENXIO - node was not found
+ *		-ENOMEM - allocations failed
+ *
+ * On error, the tree is not modified.
+ */
+struct avlrcu_node *avlrcu_delete(struct avlrcu_root *root, const struct avlrcu_node *match)
+{
+	struct avlrcu_node *target;
+	struct avlrcu_path path;
+	u64 start = latency_start();
+
+	target = write_search(root, match, &path);
+	if (!target) {
+		latency_record(root, AVLRCU_LAT_DELETE, start);
+		return ERR_PTR(-ENXIO);
+	}
+
+	return delete_target(root, target, &path, start);
+}
+
+/*
+ * linked_path() - is the node linked in the current version of the tree ?
+ * @root - root of the tree
+ * @node - the node
+ * @path - filled in with the ancestors & the node, as if found by a descent
+ *
+ * Climbs to the root, no cmp() calls.
+ */
+static bool linked_path(struct avlrcu_root *root, struct avlrcu_node *node, struct avlrcu_path *path)
+{
+	struct avlrcu_node *parent;
+	int i;
+
+	/* bottom-up first */
+	path->depth = 0;
+	for (;;) {
+		parent = node->parent;
+		if (*get_pnode(root, parent) != node)
+			return false;
+
+		path_push(path, node);
+		if (is_root(parent))
+			break;
+
+		node = strip_flags(parent);
+	}
+
+	for (i = 0; i < path->depth / 2; i++)
+		swap(path->nodes[i], path->nodes[path->depth - 1 - i]);
+
+	return true;
+}
+
+/**
+ * avlrcu_delete_node() - delete a node the caller already found
+ * @root - root of the tree
+ * @node - the node, returned by a read-side lookup
+ *
+ * Same as avlrcu_delete(), without the descent from the root.
+ * The node may be stale, an update may have replaced it with a copy since
+ * the lookup; this is checked under the lock by climbing the parent pointers.
+ * The node must still be allocated: keep the read-side section of the lookup
+ * (RCU, epoch or snapshot) until the call returns.
+ * Not for trees with AVLRCU_LAZY_PARENTS, their parents can't be climbed.
+ *
+ * Returns:	the extracted node on success
+ *		-ENXIO - the node is no longer in the tree
+ *		-EINVAL - the tree has AVLRCU_LAZY_PARENTS
+ *		-ENOMEM - allocations failed
+ */
+struct avlrcu_node *avlrcu_delete_node(struct avlrcu_root *root, const struct avlrcu_node *node)
+{
+	struct avlrcu_node *target = (struct avlrcu_node *)node;
+	struct avlrcu_path path;
+	u64 start = latency_start();
+
+	if (WARN_ON_ONCE(lazy_parents(root))) {
+		latency_record(root, AVLRCU_LAT_DELETE, start);
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (!linked_path(root, target, &path)) {
+		latency_record(root, AVLRCU_LAT_DELETE, start);
+		return ERR_PTR(-ENXIO);
+	}
+
+	return delete_target(root, target, &path, start);
 }
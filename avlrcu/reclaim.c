@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/rcupdate.h>
+
+#include "internal.h"
+
+/*
+ * Every update retires the nodes it copied. Until a grace period elapses
+ * they shadow the live tree, and during write bursts this memory can
+ * exceed the size of the tree itself.
+ *
+ * The nodes posted to RCU are accounted in batches tagged with the RCU state
+ * cookie at posting time. A batch is considered reclaimed once its grace
+ * period has elapsed. All the accounting is done under the writer lock.
+ */
+
+void reclaim_init(struct avlrcu_reclaim *reclaim)
+{
+	memset(reclaim, 0, sizeof(*reclaim));
+}
+
+static size_t reclaim_node_size(const struct avlrcu_root *root)
+{
+	return root->ops->size ? root->ops->size : sizeof(struct avlrcu_node);
+}
+
+/* drop the batches whose grace period has elapsed, oldest first */
+static void reclaim_reap(struct avlrcu_reclaim *reclaim)
+{
+	struct avlrcu_reclaim_batch *batch;
+
+	while (reclaim->count) {
+		batch = &reclaim->batch[reclaim->head];
+		if (!poll_state_synchronize_rcu(batch->cookie))
+			break;
+
+		reclaim->pending -= batch->nodes;
+		reclaim->head = (reclaim->head + 1) % AVLRCU_RECLAIM_BATCHES;
+		reclaim->count--;
+	}
+}
+
+/*
+ * reclaim_posted() - account nodes just posted to RCU
+ * @root	root of the tree
+ * @nodes	number of nodes
+ */
+void reclaim_posted(struct avlrcu_root *root, long nodes)
+{
+	struct avlrcu_reclaim *reclaim = &root->reclaim;
+	struct avlrcu_reclaim_batch *newest;
+	unsigned long cookie;
+
+	if (!nodes)
+		return;
+
+	cookie = get_state_synchronize_rcu();
+
+	reclaim_reap(reclaim);
+	reclaim->pending += nodes;
+	reclaim->retired += nodes;
+
+	trace_avlrcu_reclaim(root, nodes);
+
+	/*
+	 * same grace period as the newest batch, or no room left:
+	 * merge into the newest batch, it will wait for the later cookie
+	 */
+	if (reclaim->count) {
+		newest = &reclaim->batch[(reclaim->head + reclaim->count - 1) % AVLRCU_RECLAIM_BATCHES];
+
+		if (newest->cookie == cookie || reclaim->count == AVLRCU_RECLAIM_BATCHES) {
+			newest->cookie = cookie;
+			newest->nodes += nodes;
+			return;
+		}
+	}
+
+	newest = &reclaim->batch[(reclaim->head + reclaim->count) % AVLRCU_RECLAIM_BATCHES];
+	newest->cookie = cookie;
+	newest->nodes = nodes;
+	reclaim->count++;
+}
+
+/*
+ * reclaim_deferred() - account nodes kept alive by snapshots
+ * @root	root of the tree
+ * @nodes	number of nodes, negative when snapshots let go of them
+ */
+void reclaim_deferred(struct avlrcu_root *root, long nodes)
+{
+	root->reclaim.deferred += nodes;
+	if (nodes > 0)
+		root->reclaim.retired += nodes;
+}
+
+/**
+ * avlrcu_reclaim_stats() - get the memory retired by updates & not yet reclaimed
+ * @root	root of the tree
+ * @stats	filled in with the counters
+ *
+ * This is a write-side call and must be protected by a lock.
+ */
+void avlrcu_reclaim_stats(struct avlrcu_root *root, struct avlrcu_reclaim_stats *stats)
+{
+	struct avlrcu_reclaim *reclaim = &root->reclaim;
+	size_t size = reclaim_node_size(root);
+
+	reclaim_reap(reclaim);
+
+	stats->pending_nodes = reclaim->pending;
+	stats->pending_bytes = reclaim->pending * size;
+	stats->deferred_nodes = reclaim->deferred;
+	stats->deferred_bytes = reclaim->deferred * size;
+	stats->retired_nodes = reclaim->retired;
+}
+
+/**
+ * avlrcu_reclaim_throttle() - wait for the retired nodes to be reclaimed
+ * @root	root of the tree
+ *
+ * Writers call this after dropping the lock. If the memory posted to RCU
+ * is over the high-water mark, it waits for a grace period and for the
+ * RCU callbacks (that free the nodes) to complete. Snapshot memory is not
+ * subject to throttling, only dropping the snapshots releases it.
+ *
+ * May sleep. The counters are read without the lock, the next update
+ * drops the reclaimed batches.
+ */
+void avlrcu_reclaim_throttle(struct avlrcu_root *root)
+{
+	unsigned long high_water = READ_ONCE(root->reclaim.high_water);
+	long pending = READ_ONCE(root->reclaim.pending);
+
+	if (!high_water || pending * reclaim_node_size(root) <= high_water)
+		return;
+
+	synchronize_rcu();
+	rcu_barrier();
+}
@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/err.h>
+
+#include "test.h"
+
+/*
+ * Regression cases, each on a private tree built for it. The test tree is not touched.
+ *
+ * echo > /sys/kernel/debug/avlrcu/selftest
+ * cat /sys/kernel/debug/avlrcu/selftest
+ */
+
+// one run at a time, the result is kept for reading
+static DEFINE_TEST_REPORT(selftest_report);
+
+static int selftest_delete(struct avlrcu_root *root, unsigned long key)
+{
+	struct test_avlrcu_node match = {
+		.address = key,
+	};
+	struct test_avlrcu_node *container;
+	struct avlrcu_node *node;
+
+	node = avlrcu_delete(root, &match.node);
+	if (IS_ERR(node))
+		return PTR_ERR(node);
+
+	container = avlrcu_entry(node, struct test_avlrcu_node, node);
+	kfree_rcu(container, node.rcu);
+
+	return 0;
+}
+
+/* the keys of a tree, in order, must match the given set */
+static bool selftest_keys(const struct avlrcu_root *root, const unsigned long *keys, int count)
+{
+	const struct test_avlrcu_node *container;
+	struct avlrcu_iter iter;
+	int i = 0;
+
+	avlrcu_for_each_entry_iter(container, &iter, root, node) {
+		if (i == count || container->address != keys[i])
+			return false;
+		i++;
+	}
+
+	return i == count;
+}
+
+/*
+ * A delete on the left of a root whose right child is balanced:
+ *       2              4
+ *     1   4    ->    2   5
+ *        3 5          3
+ * the left rotation leaves the new root left heavy & the old root right heavy.
+ */
+static int selftest_delete_rol(void)
+{
+	static const unsigned long keys[] = { 2, 1, 4, 3, 5 };
+	struct avlrcu_root root;
+	int i, result;
+
+	avlrcu_init(&root, &test_ops);
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		result = test_insert(&root, keys[i]);
+		if (result)
+			goto out;
+	}
+
+	result = selftest_delete(&root, 1);
+	if (result)
+		goto out;
+
+	if (test_height(rcu_dereference_protected(root.root, true)) < 0) {
+		test_printf(&selftest_report, "delete_rol: balance factors don't match the heights\n");
+		result = -EINVAL;
+	}
+
+out:
+	test_destroy(&root);
+
+	return result;
+}
+
+#define SELFTEST_SNAPSHOT_KEYS	1024
+
+/*
+ * A snapshot is read-only: updates after it was taken, rotations included,
+ * change neither its keys nor its shape (balance factors included).
+ */
+static int selftest_snapshot(void)
+{
+	static unsigned long keys[SELFTEST_SNAPSHOT_KEYS];
+	struct avlrcu_snapshot *snap;
+	struct avlrcu_root root;
+	int i, before, after, result;
+	unsigned long key;
+
+	avlrcu_init(&root, &test_ops);
+
+	/* odd keys, in a scattered order (a multiplier coprime with the count) */
+	for (i = 0; i < SELFTEST_SNAPSHOT_KEYS; i++) {
+		keys[i] = 2 * i + 1;
+		result = test_insert(&root, 2 * ((i * 389) % SELFTEST_SNAPSHOT_KEYS) + 1);
+		if (result)
+			goto out;
+	}
+
+	snap = avlrcu_snapshot(&root);
+	if (IS_ERR(snap)) {
+		result = PTR_ERR(snap);
+		goto out;
+	}
+	before = test_height(rcu_dereference_protected(snap->root.root, true));
+
+	/* the even keys fill the gaps (insert rotations), then deletes in the upper half */
+	for (key = 2; key <= SELFTEST_SNAPSHOT_KEYS; key += 2) {
+		result = test_insert(&root, key);
+		if (result)
+			goto put;
+	}
+
+	for (key = SELFTEST_SNAPSHOT_KEYS + 1; key < 2 * SELFTEST_SNAPSHOT_KEYS; key += 4) {
+		result = selftest_delete(&root, key);
+		if (result)
+			goto put;
+	}
+
+	/* balance factors changed in place don't match the heights any more */
+	after = test_height(rcu_dereference_protected(snap->root.root, true));
+
+	if (after < 0 || after != before) {
+		test_printf(&selftest_report, "snapshot shape changed: height %d -> %d\n", before, after);
+		result = -EINVAL;
+	}
+	else if (!selftest_keys(&snap->root, keys, SELFTEST_SNAPSHOT_KEYS)) {
+		test_printf(&selftest_report, "snapshot keys changed\n");
+		result = -EINVAL;
+	}
+
+put:
+	avlrcu_snapshot_put(snap);
+out:
+	test_destroy(&root);
+
+	return result;
+}
+
+/* every child points back to its parent (with the side flag) */
+static bool selftest_parents(const struct avlrcu_root *root)
+{
+	const struct avlrcu_node *node;
+	struct avlrcu_iter iter;
+
+	node = rcu_dereference_protected(root->root, true);
+	if (node && !is_root(node->parent))
+		return false;
+
+	for (node = avlrcu_iter_first(&iter, root); node; node = avlrcu_iter_next(&iter)) {
+		if (node->left && node->left->parent != make_left(node))
+			return false;
+		if (node->right && node->right->parent != make_right(node))
+			return false;
+	}
+
+	return true;
+}
+
+#define SELFTEST_LAZY_KEYS	256
+
+/*
+ * With AVLRCU_LAZY_PARENTS, the old children keep stale parents after the updates.
+ * Both delete strategies, snapshots & replaces must climb the descent path only,
+ * the parents are repaired for the walks of the tree freed at the end.
+ */
+static int selftest_lazy_parents(void)
+{
+	static unsigned long keys[SELFTEST_LAZY_KEYS / 2];
+	struct test_avlrcu_node *container;
+	struct avlrcu_snapshot *snap = NULL;
+	struct avlrcu_root root;
+	unsigned long key;
+	int i, result;
+
+	avlrcu_init(&root, &test_ops);
+	root.flags = AVLRCU_LAZY_PARENTS;
+
+	for (i = 0; i < SELFTEST_LAZY_KEYS; i++) {
+		result = test_insert(&root, (i * 97) % SELFTEST_LAZY_KEYS + 1);
+		if (result)
+			goto out;
+	}
+
+	/* the odd keys go, the first half by unwind, the second by swap & under a snapshot */
+	for (key = 1; key <= SELFTEST_LAZY_KEYS; key += 2) {
+		if (key == SELFTEST_LAZY_KEYS / 2 + 1) {
+			root.flags |= AVLRCU_DELETE_SWAP;
+
+			snap = avlrcu_snapshot(&root);
+			if (IS_ERR(snap)) {
+				result = PTR_ERR(snap);
+				snap = NULL;
+				goto out;
+			}
+		}
+
+		result = selftest_delete(&root, key);
+		if (result)
+			goto out;
+	}
+
+	avlrcu_snapshot_put(snap);
+	snap = NULL;
+
+	/* the even keys stay, replaced with new nodes, every 4th deleted & inserted back */
+	for (key = 2; key <= SELFTEST_LAZY_KEYS; key += 2) {
+		keys[key / 2 - 1] = key;
+
+		container = kzalloc(sizeof(struct test_avlrcu_node), GFP_KERNEL);
+		if (!container) {
+			result = -ENOMEM;
+			goto out;
+		}
+		container->address = key;
+
+		result = avlrcu_replace(&root, &container->node, &container->node);
+		if (result) {
+			kfree(container);
+			goto out;
+		}
+
+		if (key % 8)
+			continue;
+
+		result = selftest_delete(&root, key);
+		if (result)
+			goto out;
+
+		result = test_insert(&root, key);
+		if (result)
+			goto out;
+	}
+
+	/* the retired nodes are gone, the stale parents point to freed memory */
+	synchronize_rcu();
+	rcu_barrier();
+
+	if (!selftest_keys(&root, keys, ARRAY_SIZE(keys))) {
+		test_printf(&selftest_report, "lazy_parents: keys changed\n");
+		result = -EINVAL;
+	}
+	else if (test_height(rcu_dereference_protected(root.root, true)) < 0) {
+		test_printf(&selftest_report, "lazy_parents: balance factors don't match the heights\n");
+		result = -EINVAL;
+	}
+	else {
+		repair_parents(&root);
+		if (!selftest_parents(&root)) {
+			test_printf(&selftest_report, "lazy_parents: parents not repaired\n");
+			result = -EINVAL;
+		}
+	}
+
+out:
+	if (snap)
+		avlrcu_snapshot_put(snap);
+	test_destroy(&root);
+
+	return result;
+}
+
+struct selftest_case {
+	const char *name;
+	int (*run)(void);
+};
+
+static const struct selftest_case selftest_cases[] = {
+	{ "snapshot", selftest_snapshot },
+	{ "delete_rol", selftest_delete_rol },
+	{ "lazy_parents", selftest_lazy_parents },
+};
+
+static ssize_t selftest_write(struct file *file, const char __user *data, size_t count, loff_t *offs)
+{
+	int i, result, failed = 0;
+
+	mutex_lock(&selftest_report.lock);
+
+	selftest_report.len = 0;
+	for (i = 0; i < ARRAY_SIZE(selftest_cases); i++) {
+		result = selftest_cases[i].run();
+		test_printf(&selftest_report, "%s: %s (%d)\n", selftest_cases[i].name, result ? "FAILED" : "ok", result);
+		if (result)
+			failed++;
+	}
+	test_printf(&selftest_report, "%d of %d failed\n", failed, (int)ARRAY_SIZE(selftest_cases));
+
+	mutex_unlock(&selftest_report.lock);
+
+	*offs += count;
+	return count;
+}
+
+static struct file_operations selftest_map_ops = {
+	.owner = THIS_MODULE,
+	.open = test_report_open,
+	.read = seq_read,
+	.write = selftest_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+struct dentry *selftest_debugfs_init(struct dentry *dir)
+{
+	return debugfs_create_file("selftest", S_IRUGO | S_IWUGO, dir, &selftest_report, &selftest_map_ops);
+}
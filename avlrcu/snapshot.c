@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+
+#include "internal.h"
+
+/*
+ * Snapshots are read-only versions of a tree.
+ *
+ * While there are snapshots, updates copy the whole path up to the root
+ * (see prealloc_extend()), so published nodes never change their children
+ * and a snapshot root always sees the same version.
+ *
+ * The nodes retired by updates are kept on the newest snapshot instead of
+ * being posted to RCU. When a snapshot is dropped, its retired nodes are
+ * handed to the previous (older) snapshot, which may still see them.
+ * The oldest snapshot posts them to RCU, or to the current epoch (see epoch.c).
+ */
+
+static struct llist_node *snapshot_chain_last(struct llist_node *first, long *count)
+{
+	struct llist_node *last = first;
+
+	for (*count = 1; last->next; (*count)++)
+		last = last->next;
+
+	return last;
+}
+
+/**
+ * avlrcu_snapshot() - take a snapshot of the tree
+ * @root	root of the tree
+ *
+ * This is a write-side call and must be protected by the lock.
+ * The snapshot can be searched & iterated (struct avlrcu_iter) without the
+ * lock or RCU protection until it is dropped with avlrcu_snapshot_put().
+ *
+ * Returns the snapshot or -ENOMEM.
+ */
+struct avlrcu_snapshot *avlrcu_snapshot(struct avlrcu_root *root)
+{
+	struct avlrcu_snapshot *snap;
+
+	snap = kmalloc(sizeof(*snap), GFP_ATOMIC);
+	if (!snap)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&snap->ref);
+	avlrcu_init(&snap->root, root->ops);
+	snap->root.root = root->root;
+#ifdef AVLRCU_LATENCY
+	snap->root.count = root->count;
+#endif /* AVLRCU_LATENCY */
+	snap->tree = root;
+	init_llist_head(&snap->retired);
+
+	list_add_tail(&snap->list, &root->snapshots);
+
+	return snap;
+}
+
+static void snapshot_release(struct kref *ref)
+{
+	struct avlrcu_snapshot *snap = container_of(ref, struct avlrcu_snapshot, ref);
+	struct avlrcu_root *tree = snap->tree;
+	struct avlrcu_snapshot *older;
+	struct avlrcu_node *node, *temp;
+	struct llist_node *first;
+	long count = 0;
+
+	first = __llist_del_all(&snap->retired);
+
+	/* an older snapshot may still see the nodes */
+	if (!list_is_first(&snap->list, &tree->snapshots)) {
+		older = list_prev_entry(snap, list);
+
+		if (first)
+			__llist_add_batch(first, snapshot_chain_last(first, &count), &older->retired);
+	}
+	else if (first && epoch_retire(tree, first)) {
+		snapshot_chain_last(first, &count);
+		reclaim_deferred(tree, -count);
+	}
+	else {
+		llist_for_each_entry_safe(node, temp, first, old) {
+			tree->ops->free_rcu(node);
+			count++;
+		}
+
+		reclaim_deferred(tree, -count);
+		reclaim_posted(tree, count);
+	}
+
+	list_del(&snap->list);
+	kfree(snap);
+}
+
+/**
+ * avlrcu_snapshot_put() - drop a reference to a snapshot
+ * @snap	the snapshot
+ *
+ * This is a write-side call and must be protected by the lock of the tree
+ * the snapshot was taken from.
+ */
+void avlrcu_snapshot_put(struct avlrcu_snapshot *snap)
+{
+	kref_put(&snap->ref, snapshot_release);
+}
+
+/*
+ * snapshot_defer() - keep retired nodes alive for the snapshots
+ * @root	root of the tree
+ * @first	chain of retired nodes (linked by node->old)
+ *
+ * Returns true if the nodes were handed over to the newest snapshot,
+ * false if there are no snapshots and the caller must retire them.
+ */
+bool snapshot_defer(struct avlrcu_root *root, struct llist_node *first)
+{
+	struct avlrcu_snapshot *newest;
+	long count;
+
+	if (!has_snapshots(root))
+		return false;
+
+	if (first) {
+		newest = list_last_entry(&root->snapshots, struct avlrcu_snapshot, list);
+		__llist_add_batch(first, snapshot_chain_last(first, &count), &newest->retired);
+		reclaim_deferred(root, count);
+	}
+
+	return true;
+}
@@ -0,0 +1,558 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2021 BitDefender
+ * Written by Mircea Cirjaliu
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/prandom.h>
+#include <linux/rcupdate.h>
+#include <linux/err.h>
+
+#include "test.h"
+
+/*
+ * Stress runs on a private tree: writer & reader kthreads for a fixed duration,
+ * the tree is checked while they run & after they stop. The test tree is not touched.
+ *
+ * echo "writers=4 readers=8 seconds=60 keys=1000000 insert=40 delete=40 walk=10 dist=skewed" \
+ *	> /sys/kernel/debug/avlrcu/stress
+ * cat /sys/kernel/debug/avlrcu/stress
+ *
+ * The write returns when the run is over. Parameters left out keep their defaults.
+ */
+
+// one run at a time, the report is kept for reading
+static DEFINE_TEST_REPORT(stress_report);
+
+#define STRESS_SEED		0x5eed
+#define STRESS_MAX_THREADS	64
+
+// threads drop RCU, throttle & reschedule every chunk
+#define STRESS_CHUNK		256
+
+// nodes visited by a reader walk
+#define STRESS_WALK		32
+
+// the tree is checked this often while the threads run
+#define STRESS_CHECK_MS		100
+
+// memory waiting for RCU before the writers get throttled
+#define STRESS_HIGH_WATER	(64 << 20)
+
+struct stress_params {
+	unsigned int writers;
+	unsigned int readers;
+	unsigned int seconds;
+	unsigned int keys;		/* keys are in [1, keys] */
+	unsigned int insert;		/* % of writer ops, */
+	unsigned int delete;		/* the rest are upserts */
+	unsigned int walk;		/* % of reader ops, the rest are searches */
+	unsigned int skewed;		/* 7 of 8 ops go to 1/64 of the keys */
+};
+
+enum stress_op {
+	STRESS_INSERT,
+	STRESS_DELETE,
+	STRESS_UPSERT,
+	STRESS_SEARCH,
+	STRESS_WALK_OP,
+	STRESS_OPS,
+};
+
+static const char * const stress_ops[STRESS_OPS] = {
+	"insert", "delete", "upsert", "search", "walk",
+};
+
+struct stress_run;
+
+struct stress_thread {
+	struct task_struct *task;
+	struct stress_run *run;
+	struct rnd_state rnd;
+
+	/* owned by the thread, read after it stopped */
+	unsigned long ops[STRESS_OPS];
+	unsigned long hits[STRESS_OPS];	/* inserted, deleted, replaced, found, nodes walked */
+	unsigned long errors;
+};
+
+struct stress_run {
+	struct avlrcu_root root;
+	spinlock_t lock;		/* the writers */
+	struct stress_params params;
+	atomic_long_t count;		/* nodes in the tree, per the writers */
+	struct stress_thread threads[STRESS_MAX_THREADS];
+};
+
+static unsigned long stress_key(struct stress_thread *thread)
+{
+	const struct stress_params *params = &thread->run->params;
+	u32 r = prandom_u32_state(&thread->rnd);
+
+	if (params->skewed && (r & 7))
+		return 1 + (r >> 3) % max(params->keys / 64, 1U);
+	else
+		return 1 + prandom_u32_state(&thread->rnd) % params->keys;
+}
+
+static void stress_write_one(struct stress_thread *thread)
+{
+	struct stress_run *run = thread->run;
+	struct test_avlrcu_node match, *container = NULL;
+	struct avlrcu_node *node;
+	enum stress_op op;
+	u32 r;
+	int result;
+
+	match.address = stress_key(thread);
+
+	r = prandom_u32_state(&thread->rnd) % 100;
+	if (r < run->params.insert)
+		op = STRESS_INSERT;
+	else if (r < run->params.insert + run->params.delete)
+		op = STRESS_DELETE;
+	else
+		op = STRESS_UPSERT;
+
+	thread->ops[op]++;
+
+	/* the new nodes are allocated before taking the lock */
+	if (op != STRESS_DELETE) {
+		container = kzalloc(sizeof(struct test_avlrcu_node), GFP_KERNEL);
+		if (!container) {
+			thread->errors++;
+			return;
+		}
+		container->address = match.address;
+	}
+
+	spin_lock(&run->lock);
+
+	switch (op) {
+	case STRESS_INSERT:
+		result = avlrcu_insert(&run->root, &container->node);
+		break;
+
+	case STRESS_UPSERT:
+		result = avlrcu_upsert(&run->root, &container->node);
+		break;
+
+	default:
+		node = avlrcu_delete(&run->root, &match.node);
+		if (IS_ERR(node))
+			result = PTR_ERR(node);
+		else {
+			avlrcu_retire(&run->root, node);
+			result = 0;
+		}
+		break;
+	}
+
+	spin_unlock(&run->lock);
+
+	if (result >= 0) {
+		thread->hits[op]++;
+		if (op == STRESS_DELETE)
+			atomic_long_dec(&run->count);
+		else if (result == 0)
+			atomic_long_inc(&run->count);
+		return;
+	}
+
+	kfree(container);
+
+	/* a missing or duplicate key is the expected failure */
+	if (result != (op == STRESS_DELETE ? -ENXIO : -EEXIST))
+		thread->errors++;
+}
+
+static int stress_writer(void *arg)
+{
+	struct stress_thread *thread = arg;
+	int i;
+
+	while (!kthread_should_stop()) {
+		for (i = 0; i < STRESS_CHUNK; i++)
+			stress_write_one(thread);
+
+		avlrcu_reclaim_throttle(&thread->run->root);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* walks start at the first key >= arg */
+static int stress_filter(const struct avlrcu_node *node, const void *arg)
+{
+	const struct test_avlrcu_node *container = avlrcu_entry(node, const struct test_avlrcu_node, node);
+
+	return container->address < *(const unsigned long *)arg ? -1 : 0;
+}
+
+/* must be called in RCU read-side critical section */
+static void stress_read_one(struct stress_thread *thread)
+{
+	struct stress_run *run = thread->run;
+	const struct test_avlrcu_node *container;
+	struct test_avlrcu_node match;
+	struct avlrcu_iter iter;
+	unsigned long prev;
+	int visited = 0;
+
+	match.address = stress_key(thread);
+
+	if (prandom_u32_state(&thread->rnd) % 100 >= run->params.walk) {
+		thread->ops[STRESS_SEARCH]++;
+
+		container = avlrcu_entry_safe(avlrcu_search(&run->root, &match.node),
+					      const struct test_avlrcu_node, node);
+		if (!container)
+			return;
+
+		thread->hits[STRESS_SEARCH]++;
+		if (container->address != match.address)
+			thread->errors++;
+		return;
+	}
+
+	/* a short in-order walk, the keys must be growing */
+	thread->ops[STRESS_WALK_OP]++;
+
+	prev = match.address - 1;
+	avlrcu_for_each_entry_iter_filter(container, &iter, &run->root, node, stress_filter, &match.address) {
+		if (container->address <= prev) {
+			thread->errors++;
+			break;
+		}
+		prev = container->address;
+
+		if (++visited == STRESS_WALK)
+			break;
+	}
+
+	thread->hits[STRESS_WALK_OP] += visited;
+}
+
+static int stress_reader(void *arg)
+{
+	struct stress_thread *thread = arg;
+	int i;
+
+	while (!kthread_should_stop()) {
+		rcu_read_lock();
+
+		for (i = 0; i < STRESS_CHUNK; i++)
+			stress_read_one(thread);
+
+		rcu_read_unlock();
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* every other key, so the first searches & deletes have something to find */
+static int stress_build(struct stress_run *run)
+{
+	unsigned long key, built = 0;
+	int result;
+
+	avlrcu_init(&run->root, &test_ops);
+	run->root.reclaim.high_water = STRESS_HIGH_WATER;
+	spin_lock_init(&run->lock);
+	atomic_long_set(&run->count, 0);
+
+	for (key = 1; key <= run->params.keys; key += 2) {
+		result = test_insert(&run->root, key);
+		if (result)
+			return result;
+		atomic_long_inc(&run->count);
+
+		/* the keys are odd, count the inserts instead */
+		if (!(++built % STRESS_CHUNK)) {
+			avlrcu_reclaim_throttle(&run->root);
+			cond_resched();
+		}
+	}
+
+	return 0;
+}
+
+/* walk the whole tree under RCU, returns the number of keys out of order */
+static unsigned long stress_check_order(struct stress_run *run)
+{
+	const struct test_avlrcu_node *container;
+	struct avlrcu_iter iter;
+	unsigned long prev = 0, errors = 0;
+
+	rcu_read_lock();
+
+	avlrcu_for_each_entry_iter(container, &iter, &run->root, node) {
+		if (container->address <= prev)
+			errors++;
+		prev = container->address;
+	}
+
+	rcu_read_unlock();
+
+	return errors;
+}
+
+static void stress_stop(struct stress_run *run, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		kthread_stop(run->threads[i].task);
+}
+
+static int stress_start(struct stress_run *run)
+{
+	struct stress_thread *thread;
+	int i, count = run->params.writers + run->params.readers;
+
+	for (i = 0; i < count; i++) {
+		thread = &run->threads[i];
+		thread->run = run;
+		prandom_seed_state(&thread->rnd, STRESS_SEED + i);
+
+		if (i < run->params.writers)
+			thread->task = kthread_run(stress_writer, thread, "avlrcu_stress_w%d", i);
+		else
+			thread->task = kthread_run(stress_reader, thread, "avlrcu_stress_r%d", i - run->params.writers);
+
+		if (IS_ERR(thread->task)) {
+			stress_stop(run, i);
+			return PTR_ERR(thread->task);
+		}
+	}
+
+	return 0;
+}
+
+static void stress_print(struct stress_run *run, u64 duration, unsigned long order, int height)
+{
+	const struct stress_params *params = &run->params;
+	struct avlrcu_stats stats;
+	unsigned long ops[STRESS_OPS] = { 0 }, hits[STRESS_OPS] = { 0 };
+	unsigned long total = 0, errors = 0;
+	u64 ms = max_t(u64, div_u64(duration, NSEC_PER_MSEC), 1);
+	int i, op;
+
+	for (i = 0; i < params->writers + params->readers; i++) {
+		for (op = 0; op < STRESS_OPS; op++) {
+			ops[op] += run->threads[i].ops[op];
+			hits[op] += run->threads[i].hits[op];
+		}
+		errors += run->threads[i].errors;
+	}
+
+	rcu_read_lock();
+	avlrcu_stats(&run->root, &stats);
+	rcu_read_unlock();
+
+	test_printf(&stress_report, "stress: %u writers, %u readers, %llu ms, keys %u %s, insert %u%%, delete %u%%, walk %u%%\n",
+		params->writers, params->readers, ms, params->keys, params->skewed ? "skewed" : "uniform",
+		params->insert, params->delete, params->walk);
+
+	for (op = 0; op < STRESS_OPS; op++) {
+		if (!ops[op])
+			continue;
+
+		test_printf(&stress_report, "%-6s %12lu ops %12llu ops/s %12lu %s\n", stress_ops[op], ops[op],
+			div64_u64((u64)ops[op] * MSEC_PER_SEC, ms), hits[op],
+			op == STRESS_WALK_OP ? "nodes" : "hits");
+		total += ops[op];
+	}
+
+	test_printf(&stress_report, "total  %12lu ops %12llu ops/s\n", total, div64_u64((u64)total * MSEC_PER_SEC, ms));
+	test_printf(&stress_report, "errors: %lu\n", errors);
+
+	test_printf(&stress_report, "validator: out of order %lu, unbalanced %lu, nodes %lu (expected %ld), AVL %s\n",
+		order, stats.unbalanced, stats.nodes, atomic_long_read(&run->count), height < 0 ? "broken" : "ok");
+	test_printf(&stress_report, "height %d\n", stats.height);
+}
+
+static int stress_run(const struct stress_params *params)
+{
+	struct stress_run *run;
+	unsigned long order = 0;
+	u64 start, duration;
+	unsigned long deadline;
+	int height, result;
+
+	run = kvzalloc(sizeof(struct stress_run), GFP_KERNEL);
+	if (!run)
+		return -ENOMEM;
+	run->params = *params;
+
+	result = stress_build(run);
+	if (result)
+		goto out;
+
+	start = ktime_get_ns();
+
+	result = stress_start(run);
+	if (result)
+		goto out;
+
+	/* check the tree against the writers, stop early on a signal */
+	deadline = jiffies + msecs_to_jiffies(params->seconds * MSEC_PER_SEC);
+	while (time_before(jiffies, deadline)) {
+		if (msleep_interruptible(STRESS_CHECK_MS))
+			break;
+
+		order += stress_check_order(run);
+	}
+
+	stress_stop(run, params->writers + params->readers);
+	duration = ktime_get_ns() - start;
+
+	/* quiet now, the O(n) checks see the final tree (the heights with AVLRCU_DEBUG=n too) */
+	order += stress_check_order(run);
+	height = test_height(rcu_dereference_protected(run->root.root, true));
+
+	stress_print(run, duration, order, height);
+
+out:
+	test_destroy(&run->root);
+	kvfree(run);
+
+	return result;
+}
+
+/* the numeric knobs */
+static const struct stress_knob {
+	const char *name;
+	size_t offset;
+} stress_knobs[] = {
+	{ "writers", offsetof(struct stress_params, writers) },
+	{ "readers", offsetof(struct stress_params, readers) },
+	{ "seconds", offsetof(struct stress_params, seconds) },
+	{ "keys", offsetof(struct stress_params, keys) },
+	{ "insert", offsetof(struct stress_params, insert) },
+	{ "delete", offsetof(struct stress_params, delete) },
+	{ "walk", offsetof(struct stress_params, walk) },
+};
+
+/* input: <name>=<value> ..., dist=uniform|skewed */
+static int stress_parse(char *buf, struct stress_params *params)
+{
+	char *token, *value;
+	int i, result;
+
+	while ((token = strsep(&buf, " \t\n")) != NULL) {
+		if (!*token)
+			continue;
+
+		value = strchr(token, '=');
+		if (!value)
+			return -EINVAL;
+		*value++ = '\0';
+
+		if (!strcmp(token, "dist")) {
+			if (!strcmp(value, "uniform"))
+				params->skewed = 0;
+			else if (!strcmp(value, "skewed"))
+				params->skewed = 1;
+			else
+				return -EINVAL;
+			continue;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(stress_knobs); i++)
+			if (!strcmp(token, stress_knobs[i].name))
+				break;
+
+		if (i == ARRAY_SIZE(stress_knobs))
+			return -EINVAL;
+
+		result = kstrtouint(value, 10, (unsigned int *)((char *)params + stress_knobs[i].offset));
+		if (result)
+			return result;
+	}
+
+	if (params->writers + params->readers == 0 ||
+	    params->writers + params->readers > STRESS_MAX_THREADS)
+		return -EINVAL;
+
+	if (params->seconds == 0 || params->keys == 0)
+		return -EINVAL;
+
+	if (params->insert + params->delete > 100 || params->walk > 100)
+		return -EINVAL;
+
+	return 0;
+}
+
+static ssize_t stress_write(struct file *file, const char __user *data, size_t count, loff_t *offs)
+{
+	struct stress_params params = {
+		.writers = 2,
+		.readers = 4,
+		.seconds = 10,
+		.keys = 1 << 20,
+		.insert = 40,
+		.delete = 40,
+		.walk = 10,
+	};
+	char buf[256];
+	int result;
+
+	if (count >= sizeof(buf))
+		return -E2BIG;
+
+	memset(buf, 0, sizeof(buf));
+	if (copy_from_user(buf, data, count))
+		return -EFAULT;
+
+	result = stress_parse(buf, &params);
+	if (result)
+		return result;
+
+	mutex_lock(&stress_report.lock);
+
+	stress_report.len = 0;
+	result = stress_run(&params);
+
+	mutex_unlock(&stress_report.lock);
+
+	if (result)
+		return result;
+
+	*offs += count;
+	return count;
+}
+
+static struct file_operations stress_map_ops = {
+	.owner = THIS_MODULE,
+	.open = test_report_open,
+	.read = seq_read,
+	.write = stress_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+struct dentry *stress_debugfs_init(struct dentry *dir)
+{
+	return debugfs_create_file("stress", S_IRUGO | S_IWUGO, dir, &stress_report, &stress_map_ops);
+}
@@ -16,10 +16,13 @@
 #include <linux/slab.h>
 #include <linux/fs.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/stat.h>
 #include <linux/uaccess.h>
 #include <linux/string.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/fault-inject.h>
 
 #include "test.h"
@@ -28,6 +31,9 @@
 static struct avlrcu_root avlrcu_range;
 static DEFINE_SPINLOCK(lock);
 
+// snapshot of the object, taken on demand
+static struct avlrcu_snapshot *snapshot;
+
 // thread control
 static struct task_struct *validator;
 
@@ -60,7 +66,10 @@ static void test_free(struct avlrcu_node *node)
 	struct test_avlrcu_node *container;
 	container = avlrcu_entry(node, struct test_avlrcu_node, node);
 
-	kfree(container);
+	if (arena_contains(container))
+		arena_free(container);
+	else
+		kfree(container);
 }
 
 static void test_free_rcu(struct avlrcu_node *node)
@@ -68,7 +77,21 @@ static void test_free_rcu(struct avlrcu_node *node)
 	struct test_avlrcu_node *container;
 	container = avlrcu_entry(node, struct test_avlrcu_node, node);
 
-	kfree_rcu(container, node.rcu);
+	if (arena_contains(container))
+		arena_free_rcu(container);
+	else
+		kfree_rcu(container, node.rcu);
+}
+
+static struct avlrcu_node *test_alloc_hot(void)
+{
+	struct test_avlrcu_node *container;
+
+	container = arena_alloc();
+	if (!container)
+		return NULL;
+
+	return &container->node;
 }
 
 // match <=> current
@@ -100,18 +123,88 @@ static void test_copy(struct avlrcu_node *to, const struct avlrcu_node *from)
 	memcpy(container_to, container_from, sizeof(struct test_avlrcu_node));
 }
 
-static struct avlrcu_ops test_ops = {
+struct avlrcu_ops test_ops = {
 	.alloc = test_alloc,
 	.free = test_free,
 	.free_rcu = test_free_rcu,
 	.cmp = test_cmp,
 	.copy = test_copy,
+	.size = sizeof(struct test_avlrcu_node),
+	.alloc_hot = test_alloc_hot,
+	.hot_levels = 8,
 };
 
+void test_printf(struct test_report *report, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	report->len += vscnprintf(report->text + report->len, sizeof(report->text) - report->len, fmt, args);
+	va_end(args);
+}
+
+static int test_report_show(struct seq_file *s, void *v)
+{
+	struct test_report *report = s->private;
+
+	mutex_lock(&report->lock);
+	seq_puts(s, report->text);
+	mutex_unlock(&report->lock);
+
+	return 0;
+}
+
+int test_report_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, test_report_show, inode->i_private);
+}
+
+int test_insert(struct avlrcu_root *root, unsigned long key)
+{
+	struct test_avlrcu_node *container;
+	int result;
+
+	container = kzalloc(sizeof(struct test_avlrcu_node), GFP_KERNEL);
+	if (!container)
+		return -ENOMEM;
+	container->address = key;
+
+	result = avlrcu_insert(root, &container->node);
+	if (result)
+		kfree(container);
+
+	return result;
+}
+
+int test_height(const struct avlrcu_node *node)
+{
+	int left, right;
+
+	if (!node)
+		return 0;
+
+	left = test_height(node->left);
+	right = test_height(node->right);
+	if (left < 0 || right < 0 || node->balance != right - left || node->balance < -1 || node->balance > 1)
+		return -1;
+
+	return 1 + max(left, right);
+}
+
+void test_destroy(struct avlrcu_root *root)
+{
+	avlrcu_free(root);
+	avlrcu_epoch_destroy(root);
+
+	/* the next run starts with the memory reclaimed */
+	rcu_barrier();
+}
+
 static int prev_count = 0;
 static void validate_greater(struct avlrcu_root *root)
 {
 	struct test_avlrcu_node *container;
+	struct avlrcu_iter iter;
 	unsigned long prev;
 	int count;
 	int result = 0;
@@ -121,7 +214,8 @@ static void validate_greater(struct avlrcu_root *root)
 
 	prev = 0;
 	count = 0;
-	avlrcu_for_each_entry(container, root, node) {
+	/* walk without parent pointers, this stays in the tree version it started in */
+	avlrcu_for_each_entry_iter(container, &iter, root, node) {
 		if (prev >= container->address) {
 			result = -EINVAL;
 			break;
@@ -145,6 +239,58 @@ static void validate_greater(struct avlrcu_root *root)
 
 }
 
+#ifdef AVLRCU_HASH
+/* the size of the index, the test tree may grow past it */
+#define TEST_HASH_NODES	(1UL << 16)
+
+static unsigned long test_key(const struct avlrcu_node *node)
+{
+	return avlrcu_entry(node, struct test_avlrcu_node, node)->address;
+}
+
+/* a node the walk saw out of the index may be from an older version, check it under the lock */
+static bool hash_missing(struct avlrcu_root *root, const struct avlrcu_node *node)
+{
+	const struct avlrcu_node *found;
+	bool missing;
+
+	spin_lock(&lock);
+
+	found = avlrcu_search(root, node);
+	missing = found && avlrcu_hash_search(root, found) != found;
+
+	spin_unlock(&lock);
+
+	return missing;
+}
+
+/* the index changes together with the tree, walked under RCU, the lock only for the suspects */
+static void validate_hash(struct avlrcu_root *root)
+{
+	const struct avlrcu_node *node;
+	struct avlrcu_iter iter;
+
+	rcu_read_lock();
+
+	for (node = avlrcu_iter_first(&iter, root); node; node = avlrcu_iter_next(&iter)) {
+		if (avlrcu_hash_search(root, node) == node)
+			continue;
+
+		if (hash_missing(root, node)) {
+			pr_err("%s: node %lx not in the index\n", __func__,
+				avlrcu_entry(node, struct test_avlrcu_node, node)->address);
+			break;
+		}
+	}
+
+	rcu_read_unlock();
+}
+#else /* AVLRCU_HASH */
+static void validate_hash(struct avlrcu_root *root)
+{
+}
+#endif /* AVLRCU_HASH */
+
 static int validator_func(void *arg)
 {
 	pr_debug("validator started\n");
@@ -153,6 +299,9 @@ static int validator_func(void *arg)
 		// validate each element is greater than the last
 		validate_greater(&avlrcu_range);
 
+		// validate the exact match index follows the tree
+		validate_hash(&avlrcu_range);
+
 		msleep_interruptible(10);
 
 	} while (!kthread_should_stop());
@@ -191,6 +340,8 @@ static ssize_t insert_map(struct file *file, const char __user *data, size_t cou
 
 	spin_unlock(&lock);
 
+	avlrcu_reclaim_throttle(&avlrcu_range);
+
 	if (result == 0)
 		pr_debug("%s: success\n", __func__);
 	else
@@ -201,6 +352,48 @@ static ssize_t insert_map(struct file *file, const char __user *data, size_t cou
 	return count;
 }
 
+/* insert a node, or replace the node with the same value (a new object, same contents) */
+static ssize_t upsert_map(struct file *file, const char __user *data, size_t count, loff_t *offs)
+{
+	unsigned long value;
+	struct test_avlrcu_node *container;
+	int result;
+
+	result = kstrtoul_from_user(data, count, 16, &value);
+	if (IS_ERR_VALUE((long)result))
+		return result;
+
+	/* invalid value 0, need it for other purposes */
+	if (value == 0)
+		return -EINVAL;
+
+	pr_debug("%s: at %lx\n", __func__, value);
+
+	container = kzalloc(sizeof(struct test_avlrcu_node), GFP_ATOMIC);
+	if (!container)
+		return -ENOMEM;
+	container->address = value;
+
+	spin_lock(&lock);
+
+	result = avlrcu_upsert(&avlrcu_range, &container->node);
+
+	spin_unlock(&lock);
+
+	avlrcu_reclaim_throttle(&avlrcu_range);
+
+	if (result >= 0)
+		pr_debug("%s: %s\n", __func__, result ? "replaced" : "inserted");
+	else {
+		pr_err("%s: failed: %d\n", __func__, result);
+		kfree(container);
+	}
+	pr_debug("-\n");
+
+	*offs += count;
+	return count;
+}
+
 static unsigned long parse_input(const char __user *data, size_t count)
 {
 	char buf[32], *eol;
@@ -238,7 +431,6 @@ static ssize_t delete_map(struct file *file, const char __user *data, size_t cou
 {
 	struct test_avlrcu_node match;
 	struct avlrcu_node *node;
-	struct test_avlrcu_node *container;
 	int result = 0;
 
 	/* 0 for root or an address or error value */
@@ -259,9 +451,11 @@ static ssize_t delete_map(struct file *file, const char __user *data, size_t cou
 
 	spin_unlock(&lock);
 
+	avlrcu_reclaim_throttle(&avlrcu_range);
+
 	if (!IS_ERR(node)) {
-		container = avlrcu_entry(node, struct test_avlrcu_node, node);
-		kfree_rcu(container, node.rcu);
+		// the node may be a copy in the arena
+		test_free_rcu(node);
 		// or
 		//synchronize_rcu();
 		// cleanup payload of container...
@@ -637,6 +831,204 @@ int dump_po_open(struct inode *inode, struct file *file)
 }
 
 
+static ssize_t snapshot_write(struct file *file, const char __user *data, size_t count, loff_t *offs)
+{
+	struct avlrcu_snapshot *snap;
+
+	/* these have to match with the allocation functions */
+	spin_lock(&lock);
+
+	/* replace the previous snapshot */
+	snap = avlrcu_snapshot(&avlrcu_range);
+	if (!IS_ERR(snap)) {
+		if (snapshot)
+			avlrcu_snapshot_put(snapshot);
+		snapshot = snap;
+	}
+
+	spin_unlock(&lock);
+
+	if (IS_ERR(snap))
+		return PTR_ERR(snap);
+
+	*offs += count;
+	return count;
+}
+
+static int snapshot_show(struct seq_file *s, void *v)
+{
+	struct avlrcu_snapshot *snap = NULL;
+	struct test_avlrcu_node *container;
+	struct avlrcu_iter iter;
+
+	spin_lock(&lock);
+	if (snapshot)
+		snap = avlrcu_snapshot_get(snapshot);
+	spin_unlock(&lock);
+
+	if (!snap)
+		return 0;
+
+	/* no lock, no RCU, the snapshot keeps its nodes alive */
+	avlrcu_for_each_entry_iter(container, &iter, &snap->root, node)
+		seq_printf(s, "%lx ", container->address);
+	seq_putc(s, '\n');
+
+	spin_lock(&lock);
+	avlrcu_snapshot_put(snap);
+	spin_unlock(&lock);
+
+	return 0;
+}
+
+int snapshot_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, snapshot_show, NULL);
+}
+
+
+/* shape of the tree, walked on a snapshot, outside the lock & RCU */
+static int shape_show(struct seq_file *s, void *v)
+{
+	struct avlrcu_snapshot *snap;
+	struct avlrcu_stats stats;
+	int i;
+
+	spin_lock(&lock);
+	snap = avlrcu_snapshot(&avlrcu_range);
+	spin_unlock(&lock);
+
+	if (IS_ERR(snap))
+		return PTR_ERR(snap);
+
+	avlrcu_stats(&snap->root, &stats);
+
+	spin_lock(&lock);
+	avlrcu_snapshot_put(snap);
+	spin_unlock(&lock);
+
+	seq_printf(s, "nodes: %lu\n", stats.nodes);
+	seq_printf(s, "height: %d\n", stats.height);
+	if (stats.nodes)
+		seq_printf(s, "average depth: %lu.%02lu\n", stats.total_depth / stats.nodes,
+			   stats.total_depth * 100 / stats.nodes % 100);
+	seq_printf(s, "balance: -1 %lu, 0 %lu, +1 %lu, invalid %lu\n",
+		   stats.balance[0], stats.balance[1], stats.balance[2], stats.unbalanced);
+
+	seq_puts(s, "levels:");
+	for (i = 0; i < stats.height; i++)
+		seq_printf(s, " %lu", stats.levels[i]);
+	seq_putc(s, '\n');
+
+	return 0;
+}
+
+int shape_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, shape_show, NULL);
+}
+
+
+static ssize_t reclaim_write(struct file *file, const char __user *data, size_t count, loff_t *offs)
+{
+	unsigned long value;
+	int result;
+
+	/* high-water mark in bytes, 0 disables throttling */
+	result = kstrtoul_from_user(data, count, 0, &value);
+	if (IS_ERR_VALUE((long)result))
+		return result;
+
+	spin_lock(&lock);
+	avlrcu_range.reclaim.high_water = value;
+	spin_unlock(&lock);
+
+	*offs += count;
+	return count;
+}
+
+static int reclaim_show(struct seq_file *s, void *v)
+{
+	struct avlrcu_reclaim_stats stats;
+	unsigned long high_water;
+
+	spin_lock(&lock);
+	avlrcu_reclaim_stats(&avlrcu_range, &stats);
+	high_water = avlrcu_range.reclaim.high_water;
+	spin_unlock(&lock);
+
+	seq_printf(s, "pending: %lu nodes, %lu bytes\n", stats.pending_nodes, stats.pending_bytes);
+	seq_printf(s, "deferred: %lu nodes, %lu bytes\n", stats.deferred_nodes, stats.deferred_bytes);
+	seq_printf(s, "retired: %lu nodes\n", stats.retired_nodes);
+	seq_printf(s, "high_water: %lu bytes\n", high_water);
+
+	return 0;
+}
+
+int reclaim_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, reclaim_show, NULL);
+}
+
+
+#ifdef AVLRCU_LATENCY
+static const char *const latency_ops[AVLRCU_LAT_OPS] = {
+	[AVLRCU_LAT_INSERT] = "insert",
+	[AVLRCU_LAT_DELETE] = "delete",
+	[AVLRCU_LAT_SEARCH] = "search",
+};
+
+static const char *const latency_sizes[AVLRCU_LAT_SIZES] = {
+	"<16", "<256", "<4K", "<64K", "<1M", ">=1M",
+};
+
+/* any write resets the histograms */
+static ssize_t latency_write(struct file *file, const char __user *data, size_t count, loff_t *offs)
+{
+	avlrcu_latency_reset();
+
+	*offs += count;
+	return count;
+}
+
+/* one row per call & tree size, the counts of the log2 ns buckets */
+static int latency_show(struct seq_file *s, void *v)
+{
+	u64 hist[AVLRCU_LAT_BUCKETS];
+	u64 total;
+	int op, size, i;
+
+	seq_puts(s, "op     size  ");
+	for (i = 0; i < AVLRCU_LAT_BUCKETS; i++)
+		seq_printf(s, " %llu", i ? 1ULL << (i - 1) : 0ULL);
+	seq_putc(s, '\n');
+
+	for (op = 0; op < AVLRCU_LAT_OPS; op++) {
+		for (size = 0; size < AVLRCU_LAT_SIZES; size++) {
+			avlrcu_latency_read(op, size, hist);
+
+			for (total = 0, i = 0; i < AVLRCU_LAT_BUCKETS; i++)
+				total += hist[i];
+			if (!total)
+				continue;
+
+			seq_printf(s, "%-6s %-6s", latency_ops[op], latency_sizes[size]);
+			for (i = 0; i < AVLRCU_LAT_BUCKETS; i++)
+				seq_printf(s, " %llu", hist[i]);
+			seq_putc(s, '\n');
+		}
+	}
+
+	return 0;
+}
+
+int latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_show, NULL);
+}
+#endif /* AVLRCU_LATENCY */
+
+
 static int find_args;
 static unsigned long find_num1, find_num2;
 
@@ -722,79 +1114,325 @@ static int interval_filter(const struct avlrcu_node *crnt, const void *arg)
 		return 1;
 }
 
-static ssize_t find_read(struct file *f, char __user *buf, size_t size, loff_t *offset)
+/*
+ * The results are streamed with seq_file, any number of them.
+ * Between two read() calls the RCU read lock is dropped & the tree may change,
+ * so the position is a key: the next read restarts the search from the key after
+ * the last one emitted. Nodes inserted or deleted meanwhile may or may not show up,
+ * but no key is emitted twice & the output stays sorted.
+ */
+struct find_state {
+	int args;			/* find_args when the read started */
+	unsigned long first, last;	/* keys still to look for */
+	bool done;			/* no key left in [first, last] */
+	bool found;			/* something emitted, end the line */
+	bool eol;			/* line ended */
+	struct avlrcu_iter iter;	/* valid within one start() - stop() */
+};
+
+/* after the last key, put out the end of line */
+#define DUMMY_NODE_END_OF_LINE	((struct avlrcu_node *) 1)
+
+static const struct avlrcu_node *find_seek(struct find_state *state)
 {
-	unsigned long page;
-	char *kbuf;
-	int count = 0;
-	const struct avlrcu_node *node;
-	const struct test_avlrcu_node *container;
+	unsigned long interval[2] = {
+		[0] = state->first,
+		[1] = state->last,
+	};
 
-	pr_debug("%s: size = %d, offset = %d\n", __func__, (int)size, (int)*offset);
+	if (state->done)
+		return NULL;
 
-	if (*offset)
-		return 0;
+	if (state->args == 1) {
+		struct test_avlrcu_node match = {
+			.address = state->first,
+		};
 
-	page = get_zeroed_page(GFP_KERNEL);
-	if (!page)
-		return -ENOMEM;
-	kbuf = (char *)page;
+#ifdef AVLRCU_HASH
+		const struct avlrcu_node *node;
+
+		/* exact match, the index first, a miss may be a node just inserted */
+		node = avlrcu_hash_search(&avlrcu_range, &match.node);
+		if (node)
+			return node;
+#endif /* AVLRCU_HASH */
+		return avlrcu_search(&avlrcu_range, &match.node);
+	}
+
+	return avlrcu_iter_first_filter(&state->iter, &avlrcu_range, interval_filter, interval);
+}
+
+static void *find_start(struct seq_file *s, loff_t *pos)
+{
+	struct find_state *state = s->private;
+	const struct avlrcu_node *node;
+
+	/* (re)starting from the beginning, pick up the arguments */
+	if (*pos == 0) {
+		state->args = find_args;
+		state->first = find_args ? find_num1 : 0;
+		state->last = find_args == 2 ? find_num2 : (find_args == 1 ? find_num1 : ULONG_MAX);
+		state->done = false;
+		state->found = false;
+		state->eol = false;
+	}
 
 	rcu_read_lock();
 
-	if (find_args == 0) {
-		avlrcu_for_each_entry(container, &avlrcu_range, node) {
-			count = sprintf(kbuf, "%lx ", container->address);
-			kbuf += count;
-		}
+	node = find_seek(state);
+	if (!node && state->found && !state->eol)
+		return DUMMY_NODE_END_OF_LINE;
+
+	return (void *)node;
+}
+
+static int find_show(struct seq_file *s, void *v)
+{
+	const struct avlrcu_node *node = v;
+	const struct test_avlrcu_node *container;
+
+	if (node == DUMMY_NODE_END_OF_LINE) {
+		seq_putc(s, '\n');
+		return 0;
 	}
-	else if (find_args == 1) {
-		struct test_avlrcu_node match = {
-			.address = find_num1,
-		};
 
-		node = avlrcu_search(&avlrcu_range, &match.node);
-		container = avlrcu_entry_safe(node, const struct test_avlrcu_node, node);
-		if (container) {
-			count = sprintf(kbuf, "%lx ", container->address);
-			kbuf += count;
-		}
+	container = avlrcu_entry(node, const struct test_avlrcu_node, node);
+	seq_printf(s, "%lx ", container->address);
+
+	return 0;
+}
+
+static void *find_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	struct find_state *state = s->private;
+	const struct avlrcu_node *node = v;
+	const struct test_avlrcu_node *container;
+	unsigned long interval[2] = {
+		[0] = state->first,
+		[1] = state->last,
+	};
+
+	(*pos)++;
+
+	if (node == DUMMY_NODE_END_OF_LINE) {
+		state->done = true;
+		state->eol = true;
+		return NULL;
 	}
-	else {
-		unsigned long interval[2] = {
-			[0] = find_num1,
-			[1] = find_num2,
-		};
 
-		avlrcu_for_each_entry_filter(container, &avlrcu_range, node, interval_filter, interval) {
-			count = sprintf(kbuf, "%lx ", container->address);
-			kbuf += count;
-		}
+	/* shown, a restart resumes after it */
+	container = avlrcu_entry(node, const struct test_avlrcu_node, node);
+	state->found = true;
+	if (state->args == 1 || container->address >= state->last) {
+		state->done = true;
+		return DUMMY_NODE_END_OF_LINE;
 	}
+	state->first = container->address + 1;
+
+	/* the cursor still matches the interval it was found with */
+	node = avlrcu_iter_next_filter(&state->iter, interval_filter, interval);
+	if (!node)
+		return DUMMY_NODE_END_OF_LINE;
 
+	return (void *)node;
+}
+
+static void find_stop(struct seq_file *s, void *v)
+{
 	rcu_read_unlock();
+}
+
+static const struct seq_operations find_seq_ops = {
+	.start = find_start,
+	.next = find_next,
+	.show = find_show,
+	.stop = find_stop,
+};
+
+static int find_open(struct inode *inode, struct file *file)
+{
+	return seq_open_private(file, &find_seq_ops, sizeof(struct find_state));
+}
+
+/*
+ * Binary batch of updates & lookups: each write() is an array of struct test_batch_record,
+ * applied in order under a single hold of the lock. Each record gets a result (0 or -errno,
+ * 1 for an upsert that replaced a node), the results of the last write are read back as s32s.
+ * At most TEST_BATCH_MAX records are taken per write, the rest is left to the next write.
+ * Keys must fit in the address of the test objects (unsigned long), otherwise -EINVAL.
+ */
+#define TEST_BATCH_MAX	256
+
+struct batch_state {
+	struct mutex lock;			/* write() & read() on the same file, concurrently */
+	int count;				/* records of the last write */
+	size_t read;				/* bytes of results already read */
+	struct test_batch_record records[TEST_BATCH_MAX];
+	struct avlrcu_node *nodes[TEST_BATCH_MAX];	/* new or removed nodes, freed after unlocking */
+	s32 results[TEST_BATCH_MAX];
+};
+
+static int batch_open(struct inode *inode, struct file *file)
+{
+	struct batch_state *state;
+
+	state = kzalloc(sizeof(struct batch_state), GFP_KERNEL);
+	if (!state)
+		return -ENOMEM;
+
+	mutex_init(&state->lock);
+	file->private_data = state;
 
-	/* nothing printed ? */
-	if (kbuf == (char *)page) {
-		free_page(page);
+	return nonseekable_open(inode, file);
+}
+
+static int batch_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+
+	return 0;
+}
+
+static int batch_one(const struct test_batch_record *record, struct avlrcu_node **node)
+{
+	struct test_avlrcu_node match = {
+		.address = record->key,
+	};
+	int result;
+
+	switch (record->op) {
+	case TEST_BATCH_INSERT:
+		result = avlrcu_insert(&avlrcu_range, *node);
+		if (result == 0)
+			*node = NULL;
+		return result;
+
+	case TEST_BATCH_UPSERT:
+		result = avlrcu_upsert(&avlrcu_range, *node);
+		if (result >= 0)
+			*node = NULL;
+		return result;
+
+	case TEST_BATCH_DELETE:
+		*node = avlrcu_delete(&avlrcu_range, &match.node);
+		if (IS_ERR(*node)) {
+			result = (int)PTR_ERR(*node);
+			*node = NULL;
+			return result;
+		}
 		return 0;
+
+	case TEST_BATCH_FIND:
+		rcu_read_lock();
+		result = avlrcu_search(&avlrcu_range, &match.node) ? 0 : -ENOENT;
+		rcu_read_unlock();
+		return result;
+
+	default:
+		return -EINVAL;
 	}
+}
 
-	*kbuf = '\n';
-	kbuf++;
+static ssize_t batch_write(struct file *file, const char __user *data, size_t count, loff_t *offs)
+{
+	struct batch_state *state = file->private_data;
+	struct test_batch_record *record;
+	struct test_avlrcu_node *container;
+	int nr, i;
 
-	count = kbuf - (char *)page;
-	kbuf = (char *)page;
+	if (count % sizeof(struct test_batch_record))
+		return -EINVAL;
 
-	if (copy_to_user(buf, kbuf, count)) {
-		free_page(page);
+	nr = min_t(size_t, count / sizeof(struct test_batch_record), TEST_BATCH_MAX);
+	if (!nr)
+		return -EINVAL;
+
+	mutex_lock(&state->lock);
+
+	if (copy_from_user(state->records, data, nr * sizeof(struct test_batch_record))) {
+		/* the results of the previous write no longer match the records */
+		state->count = 0;
+		mutex_unlock(&state->lock);
 		return -EFAULT;
 	}
 
-	free_page(page);
+	/* the new nodes are allocated before taking the lock */
+	for (i = 0; i < nr; i++) {
+		record = &state->records[i];
+		state->nodes[i] = NULL;
+		state->results[i] = 0;
 
-	*offset += count;
-	return count;
+		/* would be truncated to another key */
+		if (record->key > ULONG_MAX) {
+			state->results[i] = -EINVAL;
+			continue;
+		}
+
+		if (record->op != TEST_BATCH_INSERT && record->op != TEST_BATCH_UPSERT)
+			continue;
+
+		/* invalid value 0, need it for other purposes */
+		if (record->key == 0) {
+			state->results[i] = -EINVAL;
+			continue;
+		}
+
+		container = kzalloc(sizeof(struct test_avlrcu_node), GFP_KERNEL);
+		if (!container) {
+			state->results[i] = -ENOMEM;
+			continue;
+		}
+		container->address = record->key;
+		state->nodes[i] = &container->node;
+	}
+
+	spin_lock(&lock);
+
+	for (i = 0; i < nr; i++)
+		if (state->results[i] == 0)
+			state->results[i] = batch_one(&state->records[i], &state->nodes[i]);
+
+	spin_unlock(&lock);
+
+	avlrcu_reclaim_throttle(&avlrcu_range);
+
+	/* new nodes not taken by the tree & removed nodes, which may be copies in the arena */
+	for (i = 0; i < nr; i++) {
+		if (!state->nodes[i])
+			continue;
+
+		if (state->records[i].op == TEST_BATCH_DELETE)
+			test_free_rcu(state->nodes[i]);
+		else
+			kfree(avlrcu_entry(state->nodes[i], struct test_avlrcu_node, node));
+	}
+
+	state->count = nr;
+	state->read = 0;
+
+	mutex_unlock(&state->lock);
+
+	pr_debug("%s: %d records\n", __func__, nr);
+
+	return nr * sizeof(struct test_batch_record);
+}
+
+static ssize_t batch_read(struct file *file, char __user *buf, size_t size, loff_t *offset)
+{
+	struct batch_state *state = file->private_data;
+	loff_t pos;
+	ssize_t result;
+
+	mutex_lock(&state->lock);
+
+	pos = state->read;
+	result = simple_read_from_buffer(buf, size, &pos, state->results, state->count * sizeof(s32));
+	if (result > 0)
+		state->read = pos;
+
+	mutex_unlock(&state->lock);
+
+	return result;
 }
 
 static struct file_operations insert_map_ops = {
@@ -802,6 +1440,11 @@ static struct file_operations insert_map_ops = {
 	.write = insert_map,
 };
 
+static struct file_operations upsert_map_ops = {
+	.owner = THIS_MODULE,
+	.write = upsert_map,
+};
+
 static struct file_operations delete_map_ops = {
 	.owner = THIS_MODULE,
 	.write = delete_map,
@@ -853,10 +1496,58 @@ static struct file_operations dump_po_map_ops = {
 	.release = seq_release,
 };
 
+static struct file_operations snapshot_map_ops = {
+	.owner = THIS_MODULE,
+	.open = snapshot_open,
+	.read = seq_read,
+	.write = snapshot_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct file_operations shape_map_ops = {
+	.owner = THIS_MODULE,
+	.open = shape_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct file_operations reclaim_map_ops = {
+	.owner = THIS_MODULE,
+	.open = reclaim_open,
+	.read = seq_read,
+	.write = reclaim_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#ifdef AVLRCU_LATENCY
+static struct file_operations latency_map_ops = {
+	.owner = THIS_MODULE,
+	.open = latency_open,
+	.read = seq_read,
+	.write = latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif /* AVLRCU_LATENCY */
+
 static struct file_operations find_map_ops = {
 	.owner = THIS_MODULE,
+	.open = find_open,
+	.read = seq_read,
 	.write = find_write,
-	.read = find_read,
+	.llseek = seq_lseek,
+	.release = seq_release_private,
+};
+
+static struct file_operations batch_map_ops = {
+	.owner = THIS_MODULE,
+	.open = batch_open,
+	.read = batch_read,
+	.write = batch_write,
+	.release = batch_release,
 };
 
 static int __init avlrcu_debugfs_init(void)
@@ -871,6 +1562,10 @@ static int __init avlrcu_debugfs_init(void)
 	if (IS_ERR(result))
 		goto error;
 
+	result = debugfs_create_file("upsert", S_IWUGO, debugfs_dir, NULL, &upsert_map_ops);
+	if (IS_ERR(result))
+		goto error;
+
 	result = debugfs_create_file("delete", S_IWUGO, debugfs_dir, NULL, &delete_map_ops);
 	if (IS_ERR(result))
 		goto error;
@@ -911,6 +1606,40 @@ static int __init avlrcu_debugfs_init(void)
 	if (IS_ERR(result))
 		goto error;
 
+	result = debugfs_create_file("batch", S_IRUGO | S_IWUGO, debugfs_dir, NULL, &batch_map_ops);
+	if (IS_ERR(result))
+		goto error;
+
+	result = debugfs_create_file("snapshot", S_IRUGO | S_IWUGO, debugfs_dir, NULL, &snapshot_map_ops);
+	if (IS_ERR(result))
+		goto error;
+
+	result = debugfs_create_file("shape", S_IRUGO, debugfs_dir, NULL, &shape_map_ops);
+	if (IS_ERR(result))
+		goto error;
+
+	result = selftest_debugfs_init(debugfs_dir);
+	if (IS_ERR(result))
+		goto error;
+
+	result = debugfs_create_file("reclaim", S_IRUGO | S_IWUGO, debugfs_dir, NULL, &reclaim_map_ops);
+	if (IS_ERR(result))
+		goto error;
+
+#ifdef AVLRCU_LATENCY
+	result = debugfs_create_file("latency", S_IRUGO | S_IWUGO, debugfs_dir, NULL, &latency_map_ops);
+	if (IS_ERR(result))
+		goto error;
+#endif /* AVLRCU_LATENCY */
+
+	result = bench_debugfs_init(debugfs_dir);
+	if (IS_ERR(result))
+		goto error;
+
+	result = stress_debugfs_init(debugfs_dir);
+	if (IS_ERR(result))
+		goto error;
+
 #ifdef CONFIG_FAULT_INJECTION
 	result = fault_create_debugfs_attr("fail_avlrcu", debugfs_dir, &avlrcu_fault_attr);
 	if (IS_ERR(result))
@@ -929,8 +1658,18 @@ static int __init avlrcu_test_init(void)
 {
 	int result;
 
+	result = arena_init();
+	if (result)
+		return result;
+
 	avlrcu_init(&avlrcu_range, &test_ops);
 
+#ifdef AVLRCU_HASH
+	result = avlrcu_hash_init(&avlrcu_range, TEST_HASH_NODES, test_key);
+	if (result)
+		goto out_arena;
+#endif /* AVLRCU_HASH */
+
 	// create access files
 	result = avlrcu_debugfs_init();
 	if (result)
@@ -949,6 +1688,12 @@ out_debugfs:
 	debugfs_remove_recursive(debugfs_dir);
 out_tree:
 	avlrcu_free(&avlrcu_range);
+#ifdef AVLRCU_HASH
+	avlrcu_hash_destroy(&avlrcu_range);
+out_arena:
+#endif /* AVLRCU_HASH */
+	rcu_barrier();
+	arena_exit();
 
 	return result;
 }
@@ -959,8 +1704,19 @@ static void __exit avlrcu_test_exit(void)
 
 	kthread_stop(validator);
 
+	if (snapshot)
+		avlrcu_snapshot_put(snapshot);
+
 	avlrcu_free(&avlrcu_range);
 
+	// the arena slots come back through RCU callbacks
+	rcu_barrier();
+	arena_exit();
+
+#ifdef AVLRCU_HASH
+	avlrcu_hash_destroy(&avlrcu_range);
+#endif /* AVLRCU_HASH */
+
 	pr_debug("bye bye\n");
 }
 
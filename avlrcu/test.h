@@ -2,6 +2,9 @@
 #ifndef _AVLRCU_TEST_H_
 #define _AVLRCU_TEST_H_
 
+#include <linux/mm.h>
+#include <linux/mutex.h>
+
 #include "tree.h"
 #include "internal.h"
 
@@ -13,4 +16,71 @@ struct test_avlrcu_node {
 	struct avlrcu_node node;
 };
 
+/*
+ * Record of the binary "batch" file, the layout is shared with userspace.
+ * @result is ignored on write, see the results read back from the file.
+ */
+enum test_batch_op {
+	TEST_BATCH_INSERT = 1,
+	TEST_BATCH_UPSERT,
+	TEST_BATCH_DELETE,
+	TEST_BATCH_FIND,
+};
+
+struct test_batch_record {
+	__u32 op;
+	__s32 result;
+	__u64 key;
+};
+
+/* callbacks for the test objects */
+extern struct avlrcu_ops test_ops;
+
+/*
+ * Runs on private trees (bench, stress, selftest): one run at a time, under the
+ * lock, the text of the last one is kept for reading through the debugfs file.
+ */
+struct test_report {
+	struct mutex lock;
+	size_t len;
+	char text[PAGE_SIZE];
+};
+
+#define DEFINE_TEST_REPORT(_name)	\
+	struct test_report _name = { .lock = __MUTEX_INITIALIZER(_name.lock) }
+
+extern void test_printf(struct test_report *report, const char *fmt, ...);
+
+/* the .open of the report files, created with the report as data, .write runs */
+struct inode;
+struct file;
+extern int test_report_open(struct inode *inode, struct file *file);
+
+/* new test object, freed if the insert fails (-EEXIST included) */
+extern int test_insert(struct avlrcu_root *root, unsigned long key);
+
+/* height of a subtree, -1 if a balance factor is off or not right_height - left_height */
+extern int test_height(const struct avlrcu_node *node);
+
+/* free a private tree, the next run starts with the memory reclaimed */
+extern void test_destroy(struct avlrcu_root *root);
+
+/* hot memory for the top levels of the trees */
+extern int arena_init(void);
+extern void arena_exit(void);
+extern bool arena_contains(const struct test_avlrcu_node *container);
+extern struct test_avlrcu_node *arena_alloc(void);
+extern void arena_free(struct test_avlrcu_node *container);
+extern void arena_free_rcu(struct test_avlrcu_node *container);
+
+/* benchmarks, create their access files in the test directory */
+struct dentry;
+extern struct dentry *bench_debugfs_init(struct dentry *dir);
+
+/* stress runs, create their access file in the test directory */
+extern struct dentry *stress_debugfs_init(struct dentry *dir);
+
+/* regression cases, create their access file in the test directory */
+extern struct dentry *selftest_debugfs_init(struct dentry *dir);
+
 #endif /* _AVLRCU_TEST_H_ */
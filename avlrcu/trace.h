@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM avlrcu
+
+#if !defined(_AVLRCU_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _AVLRCU_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints on the write side, no cost when disabled.
+ * Nodes are identified by address (the tree doesn't know the keys),
+ * same as NODE_FMT. Durations are in ns, measured only while the event is enabled.
+ *	echo 1 > /sys/kernel/tracing/events/avlrcu/enable
+ */
+
+#ifndef _AVLRCU_TRACE_ROTATIONS_
+#define _AVLRCU_TRACE_ROTATIONS_
+#define AVLRCU_ROT_ROL		0
+#define AVLRCU_ROT_ROR		1
+#define AVLRCU_ROT_RRL		2
+#define AVLRCU_ROT_RLR		3
+#endif /* _AVLRCU_TRACE_ROTATIONS_ */
+
+#define show_rotation(kind)					\
+	__print_symbolic(kind,					\
+		{ AVLRCU_ROT_ROL, "rol" },			\
+		{ AVLRCU_ROT_ROR, "ror" },			\
+		{ AVLRCU_ROT_RRL, "rrl" },			\
+		{ AVLRCU_ROT_RLR, "rlr" })
+
+/* an insert got published */
+TRACE_EVENT(avlrcu_insert,
+	TP_PROTO(const struct avlrcu_root *root, const struct avlrcu_node *node, int depth, int copies, u64 duration),
+	TP_ARGS(root, node, depth, copies, duration),
+
+	TP_STRUCT__entry(
+		__field(const void *, root)
+		__field(unsigned long, node)
+		__field(int, depth)
+		__field(int, copies)
+		__field(u64, duration)
+	),
+
+	TP_fast_assign(
+		__entry->root = root;
+		__entry->node = (unsigned long)node;
+		__entry->depth = depth;
+		__entry->copies = copies;
+		__entry->duration = duration;
+	),
+
+	TP_printk("root=%p node=%lx depth=%d copies=%d ns=%llu",
+		__entry->root, __entry->node, __entry->depth, __entry->copies, __entry->duration)
+);
+
+/* a delete got published, node is the target */
+TRACE_EVENT(avlrcu_delete,
+	TP_PROTO(const struct avlrcu_root *root, const struct avlrcu_node *node, int depth, int copies, u64 duration),
+	TP_ARGS(root, node, depth, copies, duration),
+
+	TP_STRUCT__entry(
+		__field(const void *, root)
+		__field(unsigned long, node)
+		__field(int, depth)
+		__field(int, copies)
+		__field(u64, duration)
+	),
+
+	TP_fast_assign(
+		__entry->root = root;
+		__entry->node = (unsigned long)node;
+		__entry->depth = depth;
+		__entry->copies = copies;
+		__entry->duration = duration;
+	),
+
+	TP_printk("root=%p node=%lx depth=%d copies=%d ns=%llu",
+		__entry->root, __entry->node, __entry->depth, __entry->copies, __entry->duration)
+);
+
+/* a rotation on the new branch, retrace rotations or the generic ones (unwind & fix) */
+TRACE_EVENT(avlrcu_rotate,
+	TP_PROTO(const struct avlrcu_node *node, int kind, bool retrace),
+	TP_ARGS(node, kind, retrace),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, node)
+		__field(long, balance)
+		__field(int, kind)
+		__field(bool, retrace)
+	),
+
+	TP_fast_assign(
+		__entry->node = (unsigned long)node;
+		__entry->balance = node->balance;
+		__entry->kind = kind;
+		__entry->retrace = retrace;
+	),
+
+	TP_printk("node=%lx balance=%ld %s%s",
+		__entry->node, __entry->balance,
+		__entry->retrace ? "retrace_" : "", show_rotation(__entry->kind))
+);
+
+/* retrace reached a node (on the new branch), diff is +1 on insert & -1 on delete */
+TRACE_EVENT(avlrcu_retrace_step,
+	TP_PROTO(const struct avlrcu_node *node, int diff),
+	TP_ARGS(node, diff),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, node)
+		__field(long, balance)
+		__field(int, diff)
+	),
+
+	TP_fast_assign(
+		__entry->node = (unsigned long)node;
+		__entry->balance = node->balance;
+		__entry->diff = diff;
+	),
+
+	TP_printk("node=%lx balance=%ld diff=%d",
+		__entry->node, __entry->balance, __entry->diff)
+);
+
+/* a new branch got published */
+TRACE_EVENT(avlrcu_connect,
+	TP_PROTO(const struct avlrcu_root *root, const struct avlrcu_node *branch, int nodes),
+	TP_ARGS(root, branch, nodes),
+
+	TP_STRUCT__entry(
+		__field(const void *, root)
+		__field(unsigned long, branch)
+		__field(int, nodes)
+		__field(unsigned long, gen)
+	),
+
+	TP_fast_assign(
+		__entry->root = root;
+		__entry->branch = (unsigned long)branch;
+		__entry->nodes = nodes;
+		__entry->gen = root->gen;
+	),
+
+	TP_printk("root=%p branch=%lx nodes=%d gen=%lu",
+		__entry->root, __entry->branch, __entry->nodes, __entry->gen)
+);
+
+/* nodes retired by an update got posted to RCU */
+TRACE_EVENT(avlrcu_reclaim,
+	TP_PROTO(const struct avlrcu_root *root, long nodes),
+	TP_ARGS(root, nodes),
+
+	TP_STRUCT__entry(
+		__field(const void *, root)
+		__field(long, nodes)
+		__field(long, pending)
+		__field(unsigned long, retired)
+	),
+
+	TP_fast_assign(
+		__entry->root = root;
+		__entry->nodes = nodes;
+		__entry->pending = root->reclaim.pending;
+		__entry->retired = root->reclaim.retired;
+	),
+
+	TP_printk("root=%p nodes=%ld pending=%ld retired=%lu",
+		__entry->root, __entry->nodes, __entry->pending, __entry->retired)
+);
+
+#endif /* _AVLRCU_TRACE_H_ */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
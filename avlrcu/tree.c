@@ -16,10 +16,25 @@
 
 #include "internal.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 void avlrcu_init(struct avlrcu_root *root, struct avlrcu_ops *ops)
 {
 	root->ops = ops;
 	root->root = NULL;
+	root->gen = 0;
+	root->flags = 0;
+	seqcount_init(&root->seq);
+	root->epoch = NULL;
+	INIT_LIST_HEAD(&root->snapshots);
+	reclaim_init(&root->reclaim);
+#ifdef AVLRCU_HASH
+	root->hash = NULL;
+#endif /* AVLRCU_HASH */
+#ifdef AVLRCU_LATENCY
+	root->count = 0;
+#endif /* AVLRCU_LATENCY */
 }
 
 /**
@@ -27,25 +42,55 @@ void avlrcu_init(struct avlrcu_root *root, struct avlrcu_ops *ops)
  * @root	root of the tree
  *
  * This is a write-side call and must be protected by a lock.
- * All nodes are posted to RCU for deletion.
+ * All nodes are posted to RCU for deletion (or retired to the current epoch).
  */
 void avlrcu_free(struct avlrcu_root *root)
 {
 	struct avlrcu_ops *ops = root->ops;
 	struct avlrcu_node *node, *temp;
 	struct avlrcu_root temp_root;
+	struct llist_head chain;
+	long count = 0;
 
 	/* cut access to the tree */
 	temp_root.root = root->root;
+	publish_begin(root);
 	rcu_assign_pointer(root->root, NULL);
+#ifdef AVLRCU_LATENCY
+	WRITE_ONCE(root->count, 0);
+#endif /* AVLRCU_LATENCY */
+	publish_end(root);
+	publish_gen(root);
+
+	/* the post-order walks below climb the parent pointers, no reader needs them any more */
+	if (lazy_parents(root))
+		repair_parents(&temp_root);
+
+	/* every bucket, out of the publishing window */
+	hash_clear(root);
+
+	/* snapshots may still see the nodes, hand them over, same for the readers outside RCU */
+	if (has_snapshots(root) || root->epoch) {
+		init_llist_head(&chain);
+		avlrcu_for_each_po_safe(node, temp, &temp_root)
+			__llist_add(&node->old, &chain);
+
+		if (!snapshot_defer(root, chain.first))
+			epoch_retire(root, chain.first);
+		return;
+	}
 
 	/*
 	 * schedule all the nodes for deletion
 	 * use post-order walk to avoid nodes getting freed and links getting
 	 * broken if this iteration intersects the end of a grace period
 	 */
-	avlrcu_for_each_po_safe(node, temp, &temp_root)
+	avlrcu_for_each_po_safe(node, temp, &temp_root) {
 		ops->free_rcu(node);
+		count++;
+	}
+
+	reclaim_posted(root, count);
 }
 
 #ifdef AVLRCU_DEBUG
@@ -108,10 +153,12 @@ const struct avlrcu_node *avlrcu_search(const struct avlrcu_root *root, const st
 {
 	struct avlrcu_ops *ops = root->ops;
 	struct avlrcu_node *crnt;
+	u64 start = latency_start();
 	int result;
 
 	crnt = rcu_access_pointer(root->root);
 	while (crnt) {
+		prefetch_children(crnt);
 		result = ops->cmp(match, crnt);
 
 		if (result == 0)
@@ -122,6 +169,144 @@ const struct avlrcu_node *avlrcu_search(const struct avlrcu_root *root, const st
 			crnt = rcu_access_pointer(crnt->right);
 	}
 
+	latency_record(root, AVLRCU_LAT_SEARCH, start);
+
+	return crnt;
+}
+
+/**
+ * avlrcu_search_batch() - search for several objects in the tree at once
+ * @root	root of the tree
+ * @match	nodes to match against
+ * @found	the nodes found, NULL where there is no match
+ * @count	number of nodes to search for
+ *
+ * The descents advance level by level in lockstep, in groups of BITS_PER_LONG.
+ * Each step prefetches the next node of a descent & moves on to the other ones,
+ * so the cache misses of different descents overlap instead of adding up.
+ *
+ * Returns the number of matches.
+ */
+int avlrcu_search_batch(const struct avlrcu_root *root, const struct avlrcu_node *const match[],
+			const struct avlrcu_node *found[], int count)
+{
+	struct avlrcu_ops *ops = root->ops;
+	struct avlrcu_node *top, *crnt;
+	unsigned long pending;
+	int base, group, i;
+	int matches = 0;
+	int result;
+
+	top = rcu_access_pointer(root->root);
+
+	for (base = 0; base < count; base += BITS_PER_LONG) {
+		group = min(count - base, BITS_PER_LONG);
+
+		/* the found array holds the cursors of the descents */
+		for (i = 0; i < group; i++)
+			found[base + i] = top;
+		pending = top ? (~0UL >> (BITS_PER_LONG - group)) : 0;
+
+		while (pending) {
+			for (i = 0; i < group; i++) {
+				if (!(pending & (1UL << i)))
+					continue;
+
+				crnt = (struct avlrcu_node *)found[base + i];
+				result = ops->cmp(match[base + i], crnt);
+
+				if (result == 0) {
+					pending &= ~(1UL << i);
+					matches++;
+					continue;
+				}
+				else if (result < 0)
+					crnt = rcu_access_pointer(crnt->left);
+				else
+					crnt = rcu_access_pointer(crnt->right);
+
+				found[base + i] = crnt;
+				if (crnt)
+					prefetch(crnt);
+				else
+					pending &= ~(1UL << i);
+			}
+		}
+	}
+
+	return matches;
+}
+
+/**
+ * avlrcu_search_from() - search for an object, starting from a nearby node
+ * @root	root of the tree
+ * @hint	node returned by a previous search in the same RCU read section
+ * @match	node to match against
+ *
+ * Climbs from the hint along the parent pointers (same encoding walked by
+ * avlrcu_successor()) until the subtree contains the match, then descends.
+ * Climbing over a link on the same side as the match needs no comparison,
+ * only the ancestors bounding the subtree get compared.
+ * Nearby lookups cost O(log d), where d is the distance between the keys.
+ *
+ * Not for snapshots, they can't follow parent pointers. Nor for trees with
+ * AVLRCU_LAZY_PARENTS, the search starts from the root there.
+ */
+const struct avlrcu_node *avlrcu_search_from(const struct avlrcu_root *root, const struct avlrcu_node *hint,
+					     const struct avlrcu_node *match)
+{
+	struct avlrcu_ops *ops = root->ops;
+	const struct avlrcu_node *crnt, *bound;
+	struct avlrcu_node *parent;
+	int result, bound_result;
+
+	if (!hint || lazy_parents(root))
+		return avlrcu_search(root, match);
+
+	crnt = hint;
+	result = ops->cmp(match, crnt);
+
+	/* climb while the match is outside the subtree of crnt */
+	while (result != 0) {
+		parent = rcu_access_pointer(crnt->parent);
+		if (is_root(parent))
+			break;
+
+		/* the parent is beyond the match too */
+		if ((result < 0) == is_left_child(parent)) {
+			crnt = strip_flags(parent);
+			continue;
+		}
+
+		/* the parent bounds the subtree on the side of the match */
+		bound = strip_flags(parent);
+		bound_result = ops->cmp(match, bound);
+		if (bound_result == 0)
+			return bound;
+
+		/* the match is between the bound & crnt */
+		if ((bound_result < 0) != (result < 0))
+			break;
+
+		crnt = bound;
+		result = bound_result;
+	}
+
+	/* descend, the first step is already decided */
+	while (crnt) {
+		if (result == 0)
+			break;
+		else if (result < 0)
+			crnt = rcu_access_pointer(crnt->left);
+		else
+			crnt = rcu_access_pointer(crnt->right);
+
+		if (crnt) {
+			prefetch_children(crnt);
+			result = ops->cmp(match, crnt);
+		}
+	}
+
 	return crnt;
 }
 
@@ -130,17 +315,23 @@ const struct avlrcu_node *avlrcu_search(const struct avlrcu_root *root, const st
  * @root	root of the tree
  * @match	node to match against
  *
+ * @path	filled in with the nodes visited, the match included
+ *
  * Uses the cmp() callback to find the node that will be modified.
  * TODO: can this be merged with the read-side search
  *       that actually generates shorter code ?
  */
-struct avlrcu_node *write_search(struct avlrcu_root *root, const struct avlrcu_node *match)
+struct avlrcu_node *write_search(struct avlrcu_root *root, const struct avlrcu_node *match,
+				 struct avlrcu_path *path)
 {
 	struct avlrcu_ops *ops = root->ops;
 	struct avlrcu_node *crnt = root->root;
 	int result;
 
+	path->depth = 0;
 	while (crnt) {
+		prefetch_children(crnt);
+		path_push(path, crnt);
 		result = ops->cmp(match, crnt);
 
 		if (result == 0)
@@ -154,6 +345,30 @@ struct avlrcu_node *write_search(struct avlrcu_root *root, const struct avlrcu_n
 	return crnt;
 }
 
+/*
+ * repair_parents() - fix all the parent pointers of a tree cut from access (AVLRCU_LAZY_PARENTS)
+ * @root	root of the tree
+ *
+ * For avlrcu_free(), its post-order walk climbs the parent pointers.
+ * The stack iterator doesn't look at them.
+ */
+void repair_parents(struct avlrcu_root *root)
+{
+	struct avlrcu_node *node;
+	struct avlrcu_iter iter;
+
+	/* the writer holds the lock, the read section only keeps the iterator quiet */
+	rcu_read_lock();
+	for (node = (struct avlrcu_node *)avlrcu_iter_first(&iter, root); node;
+	     node = (struct avlrcu_node *)avlrcu_iter_next(&iter)) {
+		if (node->left)
+			node->left->parent = make_left(node);
+		if (node->right)
+			node->right->parent = make_right(node);
+	}
+	rcu_read_unlock();
+}
+
 /* in-order iteration */
 static const struct avlrcu_node *avlrcu_leftmost(const struct avlrcu_node *node)
 {
@@ -193,6 +408,10 @@ const struct avlrcu_node *avlrcu_first(const struct avlrcu_root *root)
 {
 	const struct avlrcu_node *next = rcu_access_pointer(root->root);
 
+	/* avlrcu_next() would climb stale parents, use struct avlrcu_iter */
+	if (WARN_ON_ONCE(lazy_parents(root)))
+		return NULL;
+
 	if (unlikely(!next))
 		return NULL;
 
@@ -217,6 +436,10 @@ const struct avlrcu_node *avlrcu_first_filter(const struct avlrcu_root *root, fi
 	struct avlrcu_node *left, *right, *first = NULL;
 	int result;
 
+	/* avlrcu_next_filter() would climb stale parents, use struct avlrcu_iter */
+	if (WARN_ON_ONCE(lazy_parents(root)))
+		return NULL;
+
 	if (unlikely(!subroot))
 		return NULL;
 
@@ -261,6 +484,176 @@ const struct avlrcu_node *avlrcu_next_filter(const struct avlrcu_node *node, fil
 }
 
 
+/*
+ * stack-based in-order iteration
+ *
+ * The path from the root to the cursor is kept in the iterator, every entry
+ * carries the side of its parent it hangs from, encoded like the parent pointers.
+ * Published nodes never change their children (except for the attach point
+ * of a new branch), so the iteration never leaves the tree version it started in.
+ */
+static inline void avlrcu_iter_push(struct avlrcu_iter *iter, const struct avlrcu_node *entry)
+{
+	ASSERT(iter->depth < AVLRCU_MAX_HEIGHT);
+
+	iter->path[iter->depth++] = entry;
+}
+
+static inline const struct avlrcu_node *avlrcu_iter_top(const struct avlrcu_iter *iter)
+{
+	return strip_flags(iter->path[iter->depth - 1]);
+}
+
+/* descend along the left branch, pushing the nodes on the path */
+static const struct avlrcu_node *avlrcu_iter_leftmost(struct avlrcu_iter *iter, const struct avlrcu_node *node)
+{
+	const struct avlrcu_node *next;
+
+	for (;;) {
+		next = rcu_access_pointer(node->left);
+		if (!next)
+			return node;
+
+		avlrcu_iter_push(iter, make_left(next));
+		node = next;
+	}
+}
+
+/* ascend along the right branch, popping the nodes on the path */
+static const struct avlrcu_node *avlrcu_iter_successor(struct avlrcu_iter *iter)
+{
+	const struct avlrcu_node *entry;
+
+	while (iter->depth > 1) {
+		entry = iter->path[--iter->depth];
+
+		if (is_left_child(entry))
+			return avlrcu_iter_top(iter);
+	}
+
+	/* popped the root */
+	iter->depth = 0;
+	return NULL;
+}
+
+const struct avlrcu_node *avlrcu_iter_first(struct avlrcu_iter *iter, const struct avlrcu_root *root)
+{
+	const struct avlrcu_node *next = rcu_access_pointer(root->root);
+
+	iter->depth = 0;
+	if (unlikely(!next))
+		return NULL;
+
+	avlrcu_iter_push(iter, make_right(next));
+	return avlrcu_iter_leftmost(iter, next);
+}
+
+const struct avlrcu_node *avlrcu_iter_next(struct avlrcu_iter *iter)
+{
+	const struct avlrcu_node *next;
+
+	if (unlikely(iter->depth == 0))
+		return NULL;
+
+	/* in-order LNR -> next is right */
+	next = rcu_access_pointer(avlrcu_iter_top(iter)->right);
+	if (next) {
+		avlrcu_iter_push(iter, make_right(next));
+		return avlrcu_iter_leftmost(iter, next);
+	}
+
+	return avlrcu_iter_successor(iter);
+}
+
+/**
+ * avlrcu_stats() - compute the shape of the tree
+ * @root	root of the tree (or of a snapshot)
+ * @stats	filled in with the counters
+ *
+ * A single in-order walk with the stack iterator, O(n) time & no allocations,
+ * the depth of each node is the depth of the iterator path.
+ * Must be protected by (S)RCU section, the counters describe one version of the tree.
+ * On large trees, walk a snapshot instead, it doesn't need RCU for that long.
+ */
+void avlrcu_stats(const struct avlrcu_root *root, struct avlrcu_stats *stats)
+{
+	const struct avlrcu_node *node;
+	struct avlrcu_iter iter;
+	long balance;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (node = avlrcu_iter_first(&iter, root); node; node = avlrcu_iter_next(&iter)) {
+		stats->nodes++;
+		stats->total_depth += iter.depth;
+		stats->levels[iter.depth - 1]++;
+		if (iter.depth > stats->height)
+			stats->height = iter.depth;
+
+		balance = node->balance;
+		if (balance >= -1 && balance <= 1)
+			stats->balance[balance + 1]++;
+		else
+			stats->unbalanced++;
+	}
+}
+
+const struct avlrcu_node *avlrcu_iter_first_filter(struct avlrcu_iter *iter, const struct avlrcu_root *root, filter f, const void *arg)
+{
+	const struct avlrcu_node *subroot = rcu_access_pointer(root->root);
+	const struct avlrcu_node *first = NULL;
+	int first_depth = 0;
+	int result;
+
+	iter->depth = 0;
+	if (unlikely(!subroot))
+		return NULL;
+
+	/* same descent as avlrcu_first_filter(), but remember the path */
+	avlrcu_iter_push(iter, make_right(subroot));
+	for (;;) {
+		result = f(subroot, arg);
+
+		if (result >= 0) {
+			if (result == 0) {
+				first = subroot;
+				first_depth = iter->depth;
+			}
+			subroot = rcu_access_pointer(subroot->left);
+			if (!subroot)
+				break;
+			avlrcu_iter_push(iter, make_left(subroot));
+		}
+		else {
+			subroot = rcu_access_pointer(subroot->right);
+			if (!subroot)
+				break;
+			avlrcu_iter_push(iter, make_right(subroot));
+		}
+	}
+
+	/* cut the path at the first match */
+	iter->depth = first_depth;
+
+	return first;
+}
+
+const struct avlrcu_node *avlrcu_iter_next_filter(struct avlrcu_iter *iter, filter f, const void *arg)
+{
+	const struct avlrcu_node *next;
+
+	ASSERT(iter->depth == 0 || f(avlrcu_iter_top(iter), arg) == 0);
+
+	next = avlrcu_iter_next(iter);
+	if (next && f(next, arg) != 0) {
+		iter->depth = 0;
+		return NULL;
+	}
+
+	return next;
+}
+
+
 /* post-order iteration */
 static struct avlrcu_node *avlrcu_left_deepest(struct avlrcu_node *node)
 {
@@ -367,8 +760,9 @@ int avlrcu_test_ror(struct avlrcu_root *root, const struct avlrcu_node *match)
 	struct avlrcu_node *pivot;
 	struct avlrcu_node *prealloc;
 	struct avlrcu_ctxt ctxt;
+	struct avlrcu_path path;
 
-	target = write_search(root, match);
+	target = write_search(root, match, &path);
 	if (!target)
 		return -ENXIO;
 
@@ -378,13 +772,14 @@ int avlrcu_test_ror(struct avlrcu_root *root, const struct avlrcu_node *match)
 		return -EINVAL;
 	}
 
-	avlrcu_ctxt_init(&ctxt, root);
+	avlrcu_ctxt_init(&ctxt, root, &path);
 
 	prealloc = rotate_right_generic(&ctxt, target);
 	if (!prealloc)
 		return -ENOMEM;
 
-	if (ctxt.diff != 0)
+	/* with snapshots, the branch must be extended up to the root */
+	if (ctxt.diff != 0 || has_snapshots(root))
 		prealloc = fix_diff_height(&ctxt, prealloc);
 
 	prealloc_connect(root, prealloc);
@@ -422,8 +817,9 @@ int avlrcu_test_rol(struct avlrcu_root *root, const struct avlrcu_node *match)
 	struct avlrcu_node *pivot;
 	struct avlrcu_node *prealloc;
 	struct avlrcu_ctxt ctxt;
+	struct avlrcu_path path;
 
-	target = write_search(root, match);
+	target = write_search(root, match, &path);
 	if (!target)
 		return -ENXIO;
 
@@ -433,13 +829,14 @@ int avlrcu_test_rol(struct avlrcu_root *root, const struct avlrcu_node *match)
 		return -EINVAL;
 	}
 
-	avlrcu_ctxt_init(&ctxt, root);
+	avlrcu_ctxt_init(&ctxt, root, &path);
 
 	prealloc = rotate_left_generic(&ctxt, target);
 	if (!prealloc)
 		return -ENOMEM;
 
-	if (ctxt.diff != 0)
+	/* with snapshots, the branch must be extended up to the root */
+	if (ctxt.diff != 0 || has_snapshots(root))
 		prealloc = fix_diff_height(&ctxt, prealloc);
 
 	prealloc_connect(root, prealloc);
@@ -480,8 +877,9 @@ int avlrcu_test_rrl(struct avlrcu_root *root, const struct avlrcu_node *match)
 	struct avlrcu_node *target;
 	struct avlrcu_node *prealloc;
 	struct avlrcu_ctxt ctxt;
+	struct avlrcu_path path;
 
-	target = write_search(root, match);
+	target = write_search(root, match, &path);
 	if (!target)
 		return -ENXIO;
 
@@ -495,13 +893,14 @@ int avlrcu_test_rrl(struct avlrcu_root *root, const struct avlrcu_node *match)
 		return -EINVAL;
 	}
 
-	avlrcu_ctxt_init(&ctxt, root);
+	avlrcu_ctxt_init(&ctxt, root, &path);
 
 	prealloc = rotate_right_left_generic(&ctxt, target);
 	if (!prealloc)
 		return -ENOMEM;
 
-	if (ctxt.diff != 0)
+	/* with snapshots, the branch must be extended up to the root */
+	if (ctxt.diff != 0 || has_snapshots(root))
 		prealloc = fix_diff_height(&ctxt, prealloc);
 
 	prealloc_connect(root, prealloc);
@@ -542,8 +941,9 @@ int avlrcu_test_rlr(struct avlrcu_root *root, const struct avlrcu_node *match)
 	struct avlrcu_node *target;
 	struct avlrcu_node *prealloc;
 	struct avlrcu_ctxt ctxt;
+	struct avlrcu_path path;
 
-	target = write_search(root, match);
+	target = write_search(root, match, &path);
 	if (!target)
 		return -ENXIO;
 
@@ -557,13 +957,14 @@ int avlrcu_test_rlr(struct avlrcu_root *root, const struct avlrcu_node *match)
 		return -EINVAL;
 	}
 
-	avlrcu_ctxt_init(&ctxt, root);
+	avlrcu_ctxt_init(&ctxt, root, &path);
 
 	prealloc = rotate_left_right_generic(&ctxt, target);
 	if (!prealloc)
 		return -ENOMEM;
 
-	if (ctxt.diff != 0)
+	/* with snapshots, the branch must be extended up to the root */
+	if (ctxt.diff != 0 || has_snapshots(root))
 		prealloc = fix_diff_height(&ctxt, prealloc);
 
 	prealloc_connect(root, prealloc);
@@ -581,8 +982,9 @@ int avlrcu_test_unwind(struct avlrcu_root *root, const struct avlrcu_node *match
 	struct avlrcu_node *target;
 	struct avlrcu_node *prealloc;
 	struct avlrcu_ctxt ctxt;
+	struct avlrcu_path path;
 
-	target = write_search(root, match);
+	target = write_search(root, match, &path);
 	if (!target)
 		return -ENXIO;
 
@@ -596,7 +998,7 @@ int avlrcu_test_unwind(struct avlrcu_root *root, const struct avlrcu_node *match
 		return -EINVAL;
 	}
 
-	avlrcu_ctxt_init(&ctxt, root);
+	avlrcu_ctxt_init(&ctxt, root, &path);
 
 	// the unwind function returns the bottom of the preallocated branch
 	prealloc = prealloc_unwind(&ctxt, target);
@@ -604,7 +1006,8 @@ int avlrcu_test_unwind(struct avlrcu_root *root, const struct avlrcu_node *match
 		return -ENOMEM;
 	prealloc = prealloc_top(&ctxt, prealloc);
 
-	if (ctxt.diff != 0)
+	/* with snapshots, the branch must be extended up to the root */
+	if (ctxt.diff != 0 || has_snapshots(root))
 		prealloc = fix_diff_height(&ctxt, prealloc);
 
 	prealloc_connect(root, prealloc);
@@ -4,12 +4,19 @@
 
 #include <linux/types.h>
 #include <linux/llist.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/seqlock.h>
 
 struct avlrcu_node {
 	struct avlrcu_node __rcu *parent;
 	struct avlrcu_node __rcu *left;
 	struct avlrcu_node __rcu *right;
 
+#ifdef AVLRCU_HASH
+	struct hlist_node hash;		/* entry in the exact match index */
+#endif /* AVLRCU_HASH */
+
 	union {
 		struct rcu_head rcu;
 
@@ -27,11 +34,77 @@ struct avlrcu_ops {
 	void (*free_rcu)(struct avlrcu_node *);
 	int (*cmp)(const struct avlrcu_node *, const struct avlrcu_node *);
 	void (*copy)(struct avlrcu_node *, const struct avlrcu_node *);
+	size_t size;		/* size of the object containing the node, for accounting */
+
+	/* optional, allocates the copies of the nodes on the top hot_levels of the tree */
+	struct avlrcu_node *(*alloc_hot)(void);
+	int hot_levels;
+};
+
+/* nodes posted to RCU during the same grace period */
+struct avlrcu_reclaim_batch {
+	unsigned long cookie;
+	long nodes;
+};
+
+#define AVLRCU_RECLAIM_BATCHES	8
+
+/* accounting of the nodes retired by updates, but not yet reclaimed */
+struct avlrcu_reclaim {
+	long pending;		/* posted to RCU, waiting for a grace period */
+	long deferred;		/* kept alive by snapshots */
+	unsigned long retired;	/* total retired since init */
+	unsigned long high_water;	/* bytes pending that throttle the writers, 0 means never */
+	int head, count;
+	struct avlrcu_reclaim_batch batch[AVLRCU_RECLAIM_BATCHES];
+};
+
+#ifdef AVLRCU_HASH
+/* exact match index, maintained together with the tree */
+struct avlrcu_hash {
+	unsigned long (*key)(const struct avlrcu_node *);	/* the key of the object, mixed by the index */
+	unsigned int bits;
+	struct hlist_head buckets[];
 };
+#endif /* AVLRCU_HASH */
+
+/* per tree flags (avlrcu_root.flags), may be changed between updates, under the lock */
+#define AVLRCU_LAZY_PARENTS	0x1	/* publish without fixing parents, cleared on an empty tree only, see prealloc_connect() */
+#define AVLRCU_DELETE_SWAP	0x2	/* delete by swapping with the in-order neighbour, see delete_target() */
+
+/*
+ * With AVLRCU_LAZY_PARENTS, the nodes left in place by an update keep pointing to
+ * the parents they had, even after these get retired: publishing an update is a
+ * single pointer store & the untouched nodes are never written. The writer climbs
+ * the path of its descent instead (struct avlrcu_path). Nothing may follow the
+ * parent pointers: iterate with struct avlrcu_iter, not with avlrcu_first() & co,
+ * no avlrcu_delete_node() & no hot memory (see avlrcu_repack()).
+ */
 
 struct avlrcu_root {
 	struct avlrcu_ops *ops;
 	struct avlrcu_node __rcu *root;
+	unsigned long gen;		/* bumped after each update gets published */
+	unsigned int flags;		/* AVLRCU_* above */
+	seqcount_t seq;			/* write section around publishing, see avlrcu_search_seq() */
+	struct avlrcu_epoch *epoch;	/* optional, reclamation for readers outside RCU */
+	struct list_head snapshots;	/* live snapshots, oldest first */
+	struct avlrcu_reclaim reclaim;
+#ifdef AVLRCU_HASH
+	struct avlrcu_hash *hash;	/* optional */
+#endif /* AVLRCU_HASH */
+#ifdef AVLRCU_LATENCY
+	unsigned long count;		/* nodes in the tree, size class of the latencies */
+#endif /* AVLRCU_LATENCY */
+};
+
+/* read-only version of a tree, keeps its nodes alive until the last reference is dropped */
+struct avlrcu_snapshot {
+	struct kref ref;
+	struct avlrcu_root root;	/* the version, search & iterate it like a tree */
+	struct avlrcu_root *tree;	/* the tree the version was taken from */
+	struct list_head list;		/* entry in tree->snapshots */
+	struct llist_head retired;	/* nodes retired while this was the newest snapshot */
 };
 
 /**
@@ -48,7 +121,7 @@ struct avlrcu_root {
 	   ____ptr ? avlrcu_entry(____ptr, type, member) : NULL; \
 	})
 
-/* in-order iterator */
+/* in-order iterator, follows the parent pointers (not with AVLRCU_LAZY_PARENTS) */
 extern const struct avlrcu_node *avlrcu_first(const struct avlrcu_root *root);
 extern const struct avlrcu_node *avlrcu_next(const struct avlrcu_node *node);
 
@@ -96,12 +169,86 @@ extern const struct avlrcu_node *avlrcu_next_filter(const struct avlrcu_node *no
 	     pos = avlrcu_entry_safe(avlrcu_next_filter(&(pos)->member, filter, arg), typeof(*(pos)), member))
 
 
+/*
+ * Bound on the height of an AVL tree (1.44 * log2(n + 2)).
+ * Enough for more than 2^32 nodes.
+ */
+#define AVLRCU_MAX_HEIGHT	48
+
+/*
+ * in-order iterator that keeps the path from the root in a stack
+ * it does not follow parent pointers, so it never leaves the tree version it started in
+ */
+struct avlrcu_iter {
+	int depth;
+	const struct avlrcu_node *path[AVLRCU_MAX_HEIGHT];
+};
+
+/* the nodes visited by a write-side descent, from the root down, see avlrcu_insert_at() */
+struct avlrcu_path {
+	int depth;
+	struct avlrcu_node *nodes[AVLRCU_MAX_HEIGHT];
+};
+
+/* shape of a tree, see avlrcu_stats() */
+struct avlrcu_stats {
+	unsigned long nodes;
+	int height;					/* number of levels, the longest search */
+	unsigned long total_depth;			/* sum of the depths (root at 1), / nodes for the average search */
+	unsigned long levels[AVLRCU_MAX_HEIGHT];	/* nodes on each level, root at 0 */
+	unsigned long balance[3];			/* nodes with balance -1, 0, 1 */
+	unsigned long unbalanced;			/* nodes with other balance factors, 0 for a valid tree */
+};
+
+extern void avlrcu_stats(const struct avlrcu_root *root, struct avlrcu_stats *stats);
+
+extern const struct avlrcu_node *avlrcu_iter_first(struct avlrcu_iter *iter, const struct avlrcu_root *root);
+extern const struct avlrcu_node *avlrcu_iter_next(struct avlrcu_iter *iter);
+extern const struct avlrcu_node *avlrcu_iter_first_filter(struct avlrcu_iter *iter, const struct avlrcu_root *root, filter f, const void *arg);
+extern const struct avlrcu_node *avlrcu_iter_next_filter(struct avlrcu_iter *iter, filter f, const void *arg);
+
+/**
+ * avlrcu_for_each_entry_iter - iterate in-order over tree of given type, without parent pointers
+ * @pos:	the type * to use as a loop cursor.
+ * @iter:	the struct avlrcu_iter * holding the path to the cursor.
+ * @root:	the root of the tree.
+ * @member:	the name of the avlrcu_node within the struct.
+ */
+#define avlrcu_for_each_entry_iter(pos, iter, root, member)					\
+	for (pos = avlrcu_entry_safe(avlrcu_iter_first(iter, root), typeof(*(pos)), member);	\
+	     pos != NULL;									\
+	     pos = avlrcu_entry_safe(avlrcu_iter_next(iter), typeof(*(pos)), member))
+
+/**
+ * avlrcu_for_each_entry_iter_filter() - iterate in-order over nodes that match condition, without parent pointers
+ * @pos:	the type * to use as a loop cursor.
+ * @iter:	the struct avlrcu_iter * holding the path to the cursor.
+ * @root:	the root of the tree.
+ * @member:	the name of the avlrcu_node within the struct.
+ * @filter:	filter callback to match a range of elements
+ * @arg:	filter arg to match nodes to
+ *
+ * Same semantics as avlrcu_for_each_entry_filter().
+ */
+#define avlrcu_for_each_entry_iter_filter(pos, iter, root, member, filter, arg)					\
+	for (pos = avlrcu_entry_safe(avlrcu_iter_first_filter(iter, root, filter, arg), typeof(*(pos)), member);	\
+	     pos != NULL;											\
+	     pos = avlrcu_entry_safe(avlrcu_iter_next_filter(iter, filter, arg), typeof(*(pos)), member))
+
+
 extern void avlrcu_init(struct avlrcu_root *root, struct avlrcu_ops *ops);
 
 /* write-side calls, must be protected by a lock */
 extern void avlrcu_free(struct avlrcu_root *root);
 extern int avlrcu_insert(struct avlrcu_root *root, struct avlrcu_node *node);
+extern int avlrcu_insert_at(struct avlrcu_root *root, struct avlrcu_node *node,
+			    struct avlrcu_path *path, struct avlrcu_node **link);
 extern struct avlrcu_node *avlrcu_delete(struct avlrcu_root *root, const struct avlrcu_node *match);
+extern struct avlrcu_node *avlrcu_delete_node(struct avlrcu_root *root, const struct avlrcu_node *node);
+extern int avlrcu_replace(struct avlrcu_root *root, const struct avlrcu_node *match, struct avlrcu_node *node);
+extern int avlrcu_insert_or_get(struct avlrcu_root *root, struct avlrcu_node *node, struct avlrcu_node **existing);
+extern int avlrcu_upsert(struct avlrcu_root *root, struct avlrcu_node *node);
+extern int avlrcu_repack(struct avlrcu_root *root);
 
 /* test functions, also write-side calls, must be protected by a lock */
 extern int avlrcu_test_unwind(struct avlrcu_root *root, const struct avlrcu_node *match);
@@ -112,5 +259,113 @@ extern int avlrcu_test_rlr(struct avlrcu_root *root, const struct avlrcu_node *m
 
 /* read-side calls, must be protected by (S)RCU section */
 extern const struct avlrcu_node *avlrcu_search(const struct avlrcu_root *root, const struct avlrcu_node *match);
+extern const struct avlrcu_node *avlrcu_search_from(const struct avlrcu_root *root, const struct avlrcu_node *hint,
+						    const struct avlrcu_node *match);
+extern int avlrcu_search_batch(const struct avlrcu_root *root, const struct avlrcu_node *const match[],
+			       const struct avlrcu_node *found[], int count);
+
+#ifdef AVLRCU_HASH
+/* exact match index, set up on an empty tree before use & destroyed after avlrcu_free() */
+extern int avlrcu_hash_init(struct avlrcu_root *root, unsigned long nodes, unsigned long (*key)(const struct avlrcu_node *));
+extern void avlrcu_hash_destroy(struct avlrcu_root *root);
+
+/* read-side call, must be protected by (S)RCU section, on a miss fall back to avlrcu_search() */
+extern const struct avlrcu_node *avlrcu_hash_search(const struct avlrcu_root *root, const struct avlrcu_node *match);
+#endif /* AVLRCU_HASH */
+
+/* per-CPU log2 latency histograms of the API calls, split by the size of the tree */
+enum avlrcu_latency_op {
+	AVLRCU_LAT_INSERT,	/* all the inserts, avlrcu_upsert() & avlrcu_replace() */
+	AVLRCU_LAT_DELETE,	/* all the deletes */
+	AVLRCU_LAT_SEARCH,	/* avlrcu_search() */
+	AVLRCU_LAT_OPS,
+};
+
+#ifdef AVLRCU_LATENCY
+#define AVLRCU_LAT_SIZES	6	/* < 16, < 256, < 4K, < 64K, < 1M nodes & above */
+#define AVLRCU_LAT_BUCKETS	32	/* log2 of the duration in ns, the last one is open */
+
+extern void avlrcu_latency_read(enum avlrcu_latency_op op, int size, u64 hist[AVLRCU_LAT_BUCKETS]);
+extern void avlrcu_latency_reset(void);
+#endif /* AVLRCU_LATENCY */
+
+/* per-CPU cache of recent lookups, in front of a tree */
+#define AVLRCU_CACHE_BITS	6
+#define AVLRCU_CACHE_SLOTS	(1 << AVLRCU_CACHE_BITS)
+
+struct avlrcu_cache_cpu;
+
+struct avlrcu_cache {
+	unsigned long (*hash)(const struct avlrcu_node *);	/* the key of the object, mixed by the cache */
+	struct avlrcu_cache_cpu __percpu *cpu;
+};
+
+extern int avlrcu_cache_init(struct avlrcu_cache *cache, unsigned long (*hash)(const struct avlrcu_node *));
+extern void avlrcu_cache_free(struct avlrcu_cache *cache);
+extern void avlrcu_cache_stats(struct avlrcu_cache *cache, unsigned long *hits, unsigned long *misses);
+
+/* read-side call, must be protected by (S)RCU section, trees with epochs are not cached */
+extern const struct avlrcu_node *avlrcu_search_cached(const struct avlrcu_root *root, struct avlrcu_cache *cache,
+						      const struct avlrcu_node *match);
+
+/* read-only copy of a tree in level order, searched by u64 keys, the objects are duplicated */
+struct avlrcu_frozen;
+
+extern struct avlrcu_frozen *avlrcu_freeze(const struct avlrcu_root *root, u64 (*key)(const struct avlrcu_node *));
+extern void avlrcu_frozen_free(struct avlrcu_frozen *frozen);
+
+/* read-side call, must be protected by (S)RCU section if the index is published */
+extern const struct avlrcu_node *avlrcu_frozen_search(const struct avlrcu_frozen *frozen, u64 key);
+
+/* read-side call, must be protected by (S)RCU section, the delta tree shadows the index, dead() flags tombstones */
+extern const struct avlrcu_node *avlrcu_frozen_lookup(const struct avlrcu_frozen *frozen, const struct avlrcu_root *delta,
+						      const struct avlrcu_node *match, u64 key,
+						      bool (*dead)(const struct avlrcu_node *));
+
+/* epoch based reclamation, for readers outside RCU */
+struct avlrcu_epoch;
+
+extern int avlrcu_epoch_init(struct avlrcu_root *root);
+extern void avlrcu_epoch_destroy(struct avlrcu_root *root);
+
+/* write-side calls, must be protected by a lock */
+extern void avlrcu_epoch_reclaim(struct avlrcu_root *root);
+extern void avlrcu_retire(struct avlrcu_root *root, struct avlrcu_node *node);
+
+/* read-side calls, never block */
+extern int avlrcu_epoch_enter(const struct avlrcu_root *root);
+extern void avlrcu_epoch_exit(const struct avlrcu_root *root, int idx);
+
+/* read-side call, must be protected by avlrcu_epoch_enter() or by RCU section */
+extern const struct avlrcu_node *avlrcu_search_seq(const struct avlrcu_root *root, const struct avlrcu_node *match);
+
+/* reclaim accounting */
+struct avlrcu_reclaim_stats {
+	unsigned long pending_nodes;
+	unsigned long pending_bytes;
+	unsigned long deferred_nodes;
+	unsigned long deferred_bytes;
+	unsigned long retired_nodes;
+};
+
+/* write-side call, must be protected by a lock */
+extern void avlrcu_reclaim_stats(struct avlrcu_root *root, struct avlrcu_reclaim_stats *stats);
+
+/* may sleep, must be called outside the lock, after an update */
+extern void avlrcu_reclaim_throttle(struct avlrcu_root *root);
+
+/*
+ * Snapshots, taking & dropping them are write-side calls, must be protected by the lock.
+ * A snapshot can be searched & iterated (with struct avlrcu_iter only, it can't follow
+ * parent pointers) at leisure, without the lock or RCU protection.
+ */
+extern struct avlrcu_snapshot *avlrcu_snapshot(struct avlrcu_root *root);
+extern void avlrcu_snapshot_put(struct avlrcu_snapshot *snap);
+
+static inline struct avlrcu_snapshot *avlrcu_snapshot_get(struct avlrcu_snapshot *snap)
+{
+	kref_get(&snap->ref);
+	return snap;
+}
 
 #endif /* _AVLRCU_H_ */
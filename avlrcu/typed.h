@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _AVLRCU_TYPED_H_
+#define _AVLRCU_TYPED_H_
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/rcupdate.h>
+#include <linux/err.h>
+
+#include "tree.h"
+
+/*
+ * Typed trees, generated for a container type & one of its fields as the key.
+ *
+ * DEFINE_AVLRCU_TREE(name, type, member, key_field, key_cmp) defines the ops
+ * (name##_ops) & these calls, with the key comparisons inlined:
+ *	name##_init(root)
+ *	name##_insert(root, obj)		write-side, same as avlrcu_insert()
+ *	name##_delete(root, key)		write-side, same as avlrcu_delete()
+ *	name##_search(root, key)		read-side, the object with the key
+ *	name##_lower_bound(root, key)		read-side, the first object >= key
+ *	name##_first(root) & name##_next(obj)	read-side, in-order (parent pointers, NULL with AVLRCU_LAZY_PARENTS)
+ *
+ * The keys are passed by pointer (to the type of key_field), key_cmp(a, b)
+ * compares two such pointers with the semantics of memcmp(), see below.
+ * The objects are allocated with kzalloc() & freed with kfree()/kfree_rcu(),
+ * the copies made by the updates are struct assignments, so the objects
+ * must not point into themselves (keep string keys in char arrays).
+ * The update engine still calls the ops, once per copy.
+ */
+
+/* integer keys, any width & signedness */
+#define avlrcu_key_int(a, b)	((*(a) > *(b)) - (*(a) < *(b)))
+
+/* string keys, char arrays */
+#define avlrcu_key_str(a, b)	strcmp(*(a), *(b))
+
+/* fixed size keys compared byte by byte (memcmp blobs) */
+#define avlrcu_key_blob(a, b)	memcmp((a), (b), sizeof(*(a)))
+
+#define DEFINE_AVLRCU_TREE(name, type, member, key_field, key_cmp)			\
+typedef typeof(((type *)0)->key_field) name##_key_t;					\
+											\
+static inline type *name##_entry(const struct avlrcu_node *node)			\
+{											\
+	return avlrcu_entry_safe(node, type, member);					\
+}											\
+											\
+static struct avlrcu_node *name##_alloc(void)						\
+{											\
+	type *obj = kzalloc(sizeof(type), GFP_ATOMIC);					\
+											\
+	return obj ? &obj->member : NULL;						\
+}											\
+											\
+static void name##_free(struct avlrcu_node *node)					\
+{											\
+	kfree(name##_entry(node));							\
+}											\
+											\
+static void name##_free_rcu(struct avlrcu_node *node)					\
+{											\
+	kfree_rcu(name##_entry(node), member.rcu);					\
+}											\
+											\
+static int name##_cmp(const struct avlrcu_node *match, const struct avlrcu_node *crnt)	\
+{											\
+	return key_cmp(&name##_entry(match)->key_field, &name##_entry(crnt)->key_field);	\
+}											\
+											\
+static void name##_copy(struct avlrcu_node *to, const struct avlrcu_node *from)	\
+{											\
+	*name##_entry(to) = *name##_entry(from);					\
+}											\
+											\
+static struct avlrcu_ops name##_ops __maybe_unused = {				\
+	.alloc = name##_alloc,								\
+	.free = name##_free,								\
+	.free_rcu = name##_free_rcu,							\
+	.cmp = name##_cmp,								\
+	.copy = name##_copy,								\
+	.size = sizeof(type),								\
+};											\
+											\
+static inline void name##_init(struct avlrcu_root *root)				\
+{											\
+	avlrcu_init(root, &name##_ops);							\
+}											\
+											\
+static inline int name##_insert(struct avlrcu_root *root, type *obj)			\
+{											\
+	struct avlrcu_node **link = &root->root;					\
+	struct avlrcu_node *parent;							\
+	struct avlrcu_path path;							\
+	int result;									\
+											\
+	path.depth = 0;									\
+	while (*link) {									\
+		parent = *link;								\
+		path.nodes[path.depth++] = parent;					\
+		result = key_cmp(&obj->key_field, &name##_entry(parent)->key_field);	\
+											\
+		if (unlikely(result == 0))						\
+			return -EEXIST;							\
+		else if (result < 0)							\
+			link = &parent->left;						\
+		else									\
+			link = &parent->right;						\
+	}										\
+											\
+	return avlrcu_insert_at(root, &obj->member, &path, link);			\
+}											\
+											\
+static inline type *name##_search(const struct avlrcu_root *root, const name##_key_t *key)	\
+{											\
+	const struct avlrcu_node *crnt = rcu_access_pointer(root->root);		\
+	int result;									\
+											\
+	while (crnt) {									\
+		result = key_cmp(key, &name##_entry(crnt)->key_field);			\
+											\
+		if (result == 0)							\
+			break;								\
+		else if (result < 0)							\
+			crnt = rcu_access_pointer(crnt->left);				\
+		else									\
+			crnt = rcu_access_pointer(crnt->right);				\
+	}										\
+											\
+	return name##_entry(crnt);							\
+}											\
+											\
+static inline type *name##_lower_bound(const struct avlrcu_root *root, const name##_key_t *key)	\
+{											\
+	const struct avlrcu_node *crnt = rcu_access_pointer(root->root);		\
+	const struct avlrcu_node *bound = NULL;						\
+	int result;									\
+											\
+	while (crnt) {									\
+		result = key_cmp(key, &name##_entry(crnt)->key_field);			\
+											\
+		if (result == 0)							\
+			return name##_entry(crnt);					\
+		else if (result < 0) {							\
+			bound = crnt;							\
+			crnt = rcu_access_pointer(crnt->left);				\
+		}									\
+		else									\
+			crnt = rcu_access_pointer(crnt->right);				\
+	}										\
+											\
+	return name##_entry(bound);							\
+}											\
+											\
+static inline type *name##_delete(struct avlrcu_root *root, const name##_key_t *key)	\
+{											\
+	struct avlrcu_node *node;							\
+	type *obj;									\
+											\
+	obj = name##_search(root, key);							\
+	if (!obj)									\
+		return ERR_PTR(-ENXIO);							\
+											\
+	/* lazy parents can't be climbed, the ops descend again */			\
+	if (root->flags & AVLRCU_LAZY_PARENTS)						\
+		node = avlrcu_delete(root, &obj->member);				\
+	else										\
+		node = avlrcu_delete_node(root, &obj->member);				\
+	if (IS_ERR(node))								\
+		return ERR_CAST(node);							\
+											\
+	return name##_entry(node);							\
+}											\
+											\
+static inline type *name##_first(const struct avlrcu_root *root)			\
+{											\
+	return name##_entry(avlrcu_first(root));					\
+}											\
+											\
+static inline type *name##_next(const type *obj)					\
+{											\
+	return name##_entry(avlrcu_next(&obj->member));					\
+}
+
+/*
+ * Linked payloads, for objects too large to be copied by every update.
+ *
+ * DEFINE_AVLRCU_LINK_TREE(name, type, head, key_field, key_cmp) keeps the
+ * objects out of the tree: the tree is made of small link nodes holding a copy
+ * of the key & a pointer to the object (the payload). The updates copy only
+ * the link nodes, all the copies of a link share the same payload.
+ *	name##_init(root)
+ *	name##_insert(root, obj)		write-side, -EEXIST or -ENOMEM
+ *	name##_delete(root, key)		write-side, returns the object or ERR_PTR()
+ *	name##_release(obj)			frees a deleted object after a grace period
+ *	name##_free(root)			write-side, avlrcu_free() & the objects
+ *	name##_search(root, key)		read-side
+ *	name##_lower_bound(root, key)		read-side
+ * The links can be iterated with avlrcu_for_each_entry() on struct name##_link.
+ *
+ * Lifetime of the payloads:
+ * - the tree never copies or frees them, the copies & the retired links only drop pointers
+ * - the object belongs to the tree from insert until delete, it must not change in between
+ *   (readers see it through any of the copies), replace it by delete & insert
+ * - after delete, the object must outlive the readers that may still see the old links,
+ *   name##_release() frees it with kfree_rcu() on the struct rcu_head head
+ * - readers use RCU only, snapshots & epochs don't keep the payloads alive
+ */
+#define DEFINE_AVLRCU_LINK_TREE(name, type, head, key_field, key_cmp)			\
+struct name##_link {									\
+	typeof(((type *)0)->key_field) key;	/* descents don't touch the payloads */	\
+	type *payload;				/* shared by all the copies */		\
+	struct avlrcu_node node;							\
+};											\
+											\
+DEFINE_AVLRCU_TREE(name##_links, struct name##_link, node, key, key_cmp)		\
+											\
+static inline void name##_init(struct avlrcu_root *root)				\
+{											\
+	name##_links_init(root);							\
+}											\
+											\
+static inline int name##_insert(struct avlrcu_root *root, type *obj)			\
+{											\
+	struct name##_link *link;							\
+	int result;									\
+											\
+	link = kzalloc(sizeof(*link), GFP_ATOMIC);					\
+	if (!link)									\
+		return -ENOMEM;								\
+											\
+	memcpy(&link->key, &obj->key_field, sizeof(link->key));			\
+	link->payload = obj;								\
+											\
+	result = name##_links_insert(root, link);					\
+	if (result)									\
+		kfree(link);								\
+											\
+	return result;									\
+}											\
+											\
+static inline type *name##_delete(struct avlrcu_root *root, const name##_links_key_t *key)	\
+{											\
+	struct name##_link *link;							\
+	type *obj;									\
+											\
+	link = name##_links_delete(root, key);						\
+	if (IS_ERR(link))								\
+		return ERR_CAST(link);							\
+											\
+	obj = link->payload;								\
+	avlrcu_retire(root, &link->node);						\
+											\
+	return obj;									\
+}											\
+											\
+static inline void name##_release(type *obj)						\
+{											\
+	kfree_rcu(obj, head);								\
+}											\
+											\
+static inline void name##_free(struct avlrcu_root *root)				\
+{											\
+	struct name##_link *link;							\
+											\
+	for (link = name##_links_first(root); link; link = name##_links_next(link))	\
+		name##_release(link->payload);						\
+											\
+	avlrcu_free(root);								\
+}											\
+											\
+static inline type *name##_search(const struct avlrcu_root *root, const name##_links_key_t *key)	\
+{											\
+	struct name##_link *link = name##_links_search(root, key);			\
+											\
+	return link ? link->payload : NULL;						\
+}											\
+											\
+static inline type *name##_lower_bound(const struct avlrcu_root *root, const name##_links_key_t *key)	\
+{											\
+	struct name##_link *link = name##_links_lower_bound(root, key);			\
+											\
+	return link ? link->payload : NULL;						\
+}
+
+#endif /* _AVLRCU_TYPED_H_ */